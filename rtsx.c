@@ -43,10 +43,13 @@ __FBSDID("$FreeBSD$");
 #include <sys/types.h> /* For FreeBSD 11 */
 #include <sys/errno.h>
 #include <sys/kernel.h>
+#include <sys/malloc.h>
 #include <sys/bus.h>
 #include <sys/endian.h>
+#include <machine/atomic.h>
 #include <machine/bus.h>
 #include <sys/mutex.h>
+#include <sys/proc.h>
 #include <sys/rman.h>
 #include <sys/queue.h>
 #include <sys/taskqueue.h>
@@ -77,20 +80,28 @@ __FBSDID("$FreeBSD$");
 #define	RTSX_F_8411B		0x2000
 #define	RTSX_F_8411B_QFN48	0x4000
 #define	RTSX_REVERSE_SOCKET	0x8000
+#define	RTSX_F_MMC_HS200	0x10000
 
 #define	RTSX_NREG ((0xFDAE - 0xFDA0) + (0xFD69 - 0xFD52) + (0xFE34 - 0xFE20))
+#define	RTSX_SHADOW_BASE	0xFC00	/* first register of the shadow */
+#define	RTSX_SHADOW_NREG	0x0200	/* registers 0xFC00-0xFDFF */
+#define	RTSX_PHY_NREG		0x40
 #define	SDMMC_MAXNSEGS	((MAXPHYS / PAGE_SIZE) + 1)
 
 /* The softc holds our per-instance data. */
 struct rtsx_softc {
 	struct mtx	rtsx_mtx;		/* device mutex */
 	device_t	rtsx_dev;		/* device */
-	uint16_t	rtsx_flags;		/* device flags */
+	uint32_t	rtsx_flags;		/* device flags */
 	device_t	rtsx_mmc_dev;		/* device of mmc bus */
 	struct task	rtsx_card_task;		/* card presence check task */
 	struct timeout_task
 			rtsx_card_delayed_task;	/* card insert delayed task */
 	uint32_t 	rtsx_intr_status;	/* soft interrupt status */
+	volatile uint32_t rtsx_intr_pending;	/* status acked by rtsx_intr_filter() */
+	bool		rtsx_cmd_pending;	/* command buffer running, completion unclaimed */
+	struct thread	*rtsx_req_owner;	/* thread working on the request, NULL if none */
+	bool		rtsx_req_deferred;	/* completion claimed while the owner was busy */
 	int		rtsx_irq_res_id;	/* bus IRQ resource id */
 	struct resource *rtsx_irq_res;		/* bus IRQ resource */
 	void		*rtsx_irq_cookie;	/* bus IRQ resource cookie */
@@ -106,12 +117,48 @@ struct rtsx_softc {
 	void		*rtsx_cmd_dmamem;	/* DMA mem for command transfer */
 	bus_addr_t	rtsx_cmd_buffer;	/* device visible address of the DMA segment */
 	int		rtsx_cmd_index;		/* index in rtsx_cmd_buffer */
+	int		rtsx_hostcmd_max;	/* size of a command buffer in commands */
+	int		rtsx_batch_enable;	/* batch register writes */
+	bool		rtsx_batch;		/* rtsx_write() queues in the command buffer */
+	uint64_t	rtsx_batches;		/* register write batches run */
+	int		rtsx_shadow_enable;	/* use the register shadow */
+	uint8_t		rtsx_shadow[RTSX_SHADOW_NREG];	/* last value of the registers */
+	uint8_t		rtsx_shadow_known[RTSX_SHADOW_NREG]; /* bits of rtsx_shadow known */
+	uint16_t	rtsx_phy_shadow[RTSX_PHY_NREG];	/* last value of the PHY registers */
+	bool		rtsx_phy_known[RTSX_PHY_NREG];	/* rtsx_phy_shadow is known */
+	volatile u_int	rtsx_shadow_stale;	/* card removed, shadow to be invalidated */
+	uint64_t	rtsx_shadow_read_hits;	/* register reads from the shadow */
+	uint64_t	rtsx_shadow_write_hits;	/* register writes skipped */
+	uint64_t	rtsx_shadow_phy_hits;	/* PHY accesses from the shadow */
+	int		rtsx_cmd_fill;		/* command buffer being filled */
+	int		rtsx_cmd_run;		/* command buffer last run */
 
 	bus_dma_tag_t	rtsx_data_dma_tag;	/* DMA tag for data transfer */
 	bus_dmamap_t	rtsx_data_dmamap;	/* DMA map for data transfer */
 	void		*rtsx_data_dmamem;	/* DMA mem for data transfer */
 	bus_addr_t	rtsx_data_buffer;	/* device visible address of the DMA segment */
 
+	bus_dma_tag_t	rtsx_adma_dma_tag;	/* DMA tag for ADMA descriptor table */
+	bus_dmamap_t	rtsx_adma_dmamap;	/* DMA map for ADMA descriptor table */
+	void		*rtsx_adma_dmamem;	/* DMA mem for ADMA descriptor table */
+	bus_addr_t	rtsx_adma_buffer;	/* device visible address of the DMA segment */
+
+	bus_dma_tag_t	rtsx_req_dma_tag;	/* DMA tag for request data buffer (ADMA) */
+	bus_dmamap_t	rtsx_req_dmamap;	/* DMA map for request data buffer (ADMA) */
+	bus_dma_tag_t	rtsx_req1_dma_tag;	/* DMA tag for contiguous request data buffer */
+	bus_dmamap_t	rtsx_req1_dmamap;	/* DMA map for contiguous request data buffer */
+	bus_dma_tag_t	rtsx_req_cur_tag;	/* DMA tag of the loaded request data buffer */
+	bus_dmamap_t	rtsx_req_cur_map;	/* DMA map of the loaded request data buffer */
+	bus_dma_segment_t rtsx_req_segs[SDMMC_MAXNSEGS];
+						/* segments of request data buffer */
+	int		rtsx_req_nsegs;		/* number of segments */
+	int		rtsx_adma;		/* use ADMA for data transfer */
+	uint64_t	rtsx_xfer_direct;	/* transfers done from request buffer */
+	uint64_t	rtsx_xfer_adma;		/* transfers done with ADMA */
+	uint64_t	rtsx_xfer_bounce;	/* transfers done via bounce buffer */
+	int		rtsx_cmd23;		/* use CMD 23 when the card supports it */
+	uint64_t	rtsx_xfer_cmd23;	/* transfers with a predefined block count */
+
 	u_char		rtsx_bus_busy;		/* bus busy status */
 	struct mmc_host rtsx_host;		/* host parameters */
 	int8_t		rtsx_ios_bus_width;	/* current host.ios.bus_width */
@@ -120,10 +167,102 @@ struct rtsx_softc {
 	int8_t		rtsx_ios_timing;	/* current host.ios.timing */	
 	uint8_t		rtsx_read_only;		/* card read only status */
 	uint8_t		rtsx_card_drive_sel;	/* value for RTSX_CARD_DRIVE_SEL */
+	uint8_t		rtsx_sd30_drive_sel_1v8;/* value for RTSX_SD30_DRIVE_SEL at 1.8V */
 	uint8_t		rtsx_sd30_drive_sel_3v3;/* value for RTSX_SD30_DRIVE_SEL */
+	bool		rtsx_vccq_180;		/* 1.8V signalling selected */
+	bool		rtsx_cmd11;		/* CMD 11 sent, voltage switch pending */
+	int		rtsx_drive_calib;	/* calibrate the 1.8V drive strength when tuning */
+	bool		rtsx_drive_calibrated;	/* drive strength calibrated for this card */
+	uint8_t		rtsx_sd30_drive_sel_vendor;/* rtsx_sd30_drive_sel_1v8 from vendor settings */
+	uint32_t	rtsx_tx_initial_phase;	/* initial push points of SD 3.0 modes */
+	uint32_t	rtsx_rx_initial_phase;	/* initial sample points of SD 3.0 modes */
+	uint32_t	rtsx_tuned_clock;	/* SD clock of last tuning, 0 if not tuned */
+	bool		rtsx_tuning;		/* tuning in progress */
+	enum mmc_retune_req rtsx_retune_req;	/* re-tuning requested from the mmc bus */
+	struct callout	rtsx_retune_callout;	/* re-tuning period */
+	int		rtsx_retune_period;	/* re-tuning period in seconds, 0 to disable */
+	int		rtsx_retune_crc_errors;	/* CRC errors requesting re-tuning, 0 to disable */
+	int		rtsx_crc_errors;	/* CRC errors since last tuning */
+	uint64_t	rtsx_retunes;		/* re-tunings requested */
+	uint32_t	rtsx_clock_req;		/* SD clock asked by the mmc bus */
+	int		rtsx_speed_level;	/* speed fallback level, 0 = full speed */
+	int		rtsx_speed_applied;	/* speed fallback level of the SD clock */
+	int		rtsx_speed_errors;	/* data errors in the current window */
+	int		rtsx_speed_window_start;/* ticks at the start of the error window */
+	int		rtsx_speed_ticks;	/* ticks of the last data error or level change */
+	int		rtsx_speed_threshold;	/* data errors lowering the speed, 0 to disable */
+	int		rtsx_speed_window;	/* error window in seconds */
+	int		rtsx_speed_clean;	/* seconds without error raising the speed */
+	uint64_t	rtsx_speed_downs;	/* speed level lowered */
+	uint64_t	rtsx_speed_ups;		/* speed level raised */
 	struct mmc_request *rtsx_req;		/* MMC request */
+	struct mmc_command *rtsx_curcmd;	/* command of the current phase */
+	void		(*rtsx_intr_trans_ok)(struct rtsx_softc *sc);
+						/* function to call on transfer completion */
+	struct callout	rtsx_timeout_callout;	/* request timeout */
+	bool		rtsx_card_cmd23;	/* card supports CMD 23 (from SCR, always for MMC) */
+	bool		rtsx_req_cmd23;		/* current request is preceded by CMD 23 */
+	struct mmc_command rtsx_sbc;		/* CMD 23 of the current request */
+
+	struct rtsx_cache_entry *rtsx_cache;	/* sector cache */
+	int		rtsx_cache_enable;	/* sector cache enabled */
+	uint64_t	rtsx_cache_clock;	/* sector cache LRU clock */
+	uint64_t	rtsx_cache_hits;	/* sector cache hits */
+	uint64_t	rtsx_cache_misses;	/* sector cache misses */
+
+	struct rtsx_profile *rtsx_profiles;	/* settings of known cards */
+	struct rtsx_profile *rtsx_profile;	/* profile of the present card, NULL if none */
+	int		rtsx_profile_enable;	/* card profiles enabled */
+	uint64_t	rtsx_profile_clock;	/* card profiles LRU clock */
+	uint64_t	rtsx_profile_hits;	/* tunings skipped thanks to a profile */
+
+	struct rtsx_script *rtsx_script;	/* register script replayed on resume */
+	int		rtsx_script_len;	/* entries in rtsx_script */
+	int		rtsx_script_init;	/* entries recorded by rtsx_init(), 0 if none */
+	bool		rtsx_script_rec;	/* rtsx_write() records in rtsx_script */
+	int		rtsx_resume_replay;	/* resume by replaying rtsx_script */
+	uint64_t	rtsx_resume_replays;	/* resumes done with the script */
+	uint64_t	rtsx_resume_inits;	/* resumes done with rtsx_init() */
+};
+
+/*
+ * Sector cache entry, for single block reads only.
+ */
+struct rtsx_cache_entry {
+	uint64_t	lru;			/* LRU clock of last use, 0 if invalid */
+	uint32_t	arg;			/* argument of CMD 17 */
+	uint8_t		data[MMC_SECTOR_SIZE];	/* sector data */
+};
+
+/*
+ * Settings which worked last time for a card, keyed by its CID.
+ */
+struct rtsx_profile {
+	uint64_t	lru;			/* LRU clock of last use, 0 if invalid */
+	uint32_t	cid[4];			/* card identification */
+	enum mmc_bus_timing timing;		/* timing mode of the tuning */
+	uint32_t	clock;			/* SD clock of the tuning */
+	uint8_t		rx_phase;		/* tuned sample point, 0xff if none */
+	bool		drive_calibrated;	/* drive_sel comes from a calibration */
+	uint8_t		drive_sel;		/* 1.8V drive strength */
+	int		speed_level;		/* speed fallback level */
+};
+
+/*
+ * Register script entry: the writes of rtsx_init() followed at suspend
+ * time by the state of the shadowed and PHY registers.
+ */
+struct rtsx_script {
+	uint16_t	reg;			/* register or PHY address */
+	uint16_t	val;			/* value, or delay in us */
+	uint8_t		mask;			/* mask of a register write */
+	uint8_t		op;			/* RTSX_SCRIPT_* */
 };
 
+#define	RTSX_SCRIPT_WRITE	0	/* rtsx_write() */
+#define	RTSX_SCRIPT_PHY		1	/* rtsx_write_phy() */
+#define	RTSX_SCRIPT_DELAY	2	/* DELAY() */
+
 static const struct rtsx_device {
 	uint16_t	vendor;
 	uint16_t	device;
@@ -157,9 +296,11 @@ static const struct rtsx_device {
 
 static int	rtsx_dma_alloc(struct rtsx_softc *sc);
 static void	rtsx_dmamap_cb(void *arg, bus_dma_segment_t *segs, int nsegs, int error);
+static void	rtsx_req_dmamap_cb(void *arg, bus_dma_segment_t *segs, int nsegs, int error);
 static void	rtsx_dma_free(struct rtsx_softc *sc);
+static int	rtsx_req_dma_load(struct rtsx_softc *sc, struct mmc_command *cmd);
+static int	rtsx_intr_filter(void *arg);
 static void	rtsx_intr(void *arg);
-static int	rtsx_wait_intr(struct rtsx_softc *sc, int mask, int timeout);
 static void	rtsx_handle_card_present(struct rtsx_softc *sc);
 static void	rtsx_card_task(void *arg, int pending __unused);
 static bool	rtsx_is_card_present(struct rtsx_softc *sc);
@@ -168,33 +309,86 @@ static int	rtsx_led_enable(struct rtsx_softc *sc);
 static int	rtsx_led_disable(struct rtsx_softc *sc);
 #endif /* For led */
 static int	rtsx_init(struct rtsx_softc *sc);
+static int	rtsx_init_batched(struct rtsx_softc *sc);
+static int	rtsx_init_record(struct rtsx_softc *sc);
+static bool	rtsx_script_add(struct rtsx_softc *sc, uint8_t op, uint16_t reg, uint8_t mask, uint16_t val);
+static int	rtsx_script_replay(struct rtsx_softc *sc);
 static int	rtsx_map_sd_drive(int index);
-static int	rtsx_rts5227_fill_driving(struct rtsx_softc *sc);
-static int	rtsx_rts5249_fill_driving(struct rtsx_softc *sc);
+static int	rtsx_rts5227_fill_driving(struct rtsx_softc *sc, int vccq);
+static int	rtsx_rts5249_fill_driving(struct rtsx_softc *sc, int vccq);
+static int	rtsx_shadow_index(uint16_t addr);
+static void	rtsx_shadow_invalidate(struct rtsx_softc *sc);
+static void	rtsx_shadow_check(struct rtsx_softc *sc);
+static bool	rtsx_shadow_match(struct rtsx_softc *sc, uint16_t addr, uint8_t mask, uint8_t val);
 static int	rtsx_read(struct rtsx_softc *, uint16_t, uint8_t *);
 static int	rtsx_read_cfg(struct rtsx_softc *sc, uint8_t func, uint16_t addr, uint32_t *val);
 static int	rtsx_write(struct rtsx_softc *sc, uint16_t addr, uint8_t mask, uint8_t val);
 static int	rtsx_read_phy(struct rtsx_softc *sc, uint8_t addr, uint16_t *val);
 static int	rtsx_write_phy(struct rtsx_softc *sc, uint8_t addr, uint16_t val);
+static int	rtsx_set_bus_width(struct rtsx_softc *sc, enum mmc_bus_width width);
 static int	rtsx_set_sd_timing(struct rtsx_softc *sc, enum mmc_bus_timing timing);
+static int	rtsx_clk_to_div_n(struct rtsx_softc *sc, int clk);
+static int	rtsx_div_n_to_clk(struct rtsx_softc *sc, int n);
+static int	rtsx_ssc_div_n(struct rtsx_softc *sc, int clk, int *div);
 static int	rtsx_set_sd_clock(struct rtsx_softc *sc, uint32_t freq);
 static int	rtsx_stop_sd_clock(struct rtsx_softc *sc);
-static int	rtsx_switch_sd_clock(struct rtsx_softc *sc, uint8_t n, int div, int mcu);
+static int	rtsx_switch_sd_clock(struct rtsx_softc *sc, uint8_t n, int div, int mcu,
+				     uint8_t ssc_depth, bool vpclk);
+static int	rtsx_sd_change_phase(struct rtsx_softc *sc, uint8_t phase, bool rx);
 static int	rtsx_bus_power_off(struct rtsx_softc *sc);
 static int	rtsx_bus_power_on(struct rtsx_softc *sc);
+static int	rtsx_switch_output_voltage(struct rtsx_softc *sc, int vccq);
+static int	rtsx_wait_voltage_stable_1(struct rtsx_softc *sc);
+static int	rtsx_wait_voltage_stable_2(struct rtsx_softc *sc);
 static uint8_t	rtsx_response_type(uint16_t mmc_rsp);
 static void	rtsx_init_cmd(struct rtsx_softc *sc, struct mmc_command *cmd);
 static void	rtsx_push_cmd(struct rtsx_softc *sc, uint8_t cmd, uint16_t reg,
 			      uint8_t mask, uint8_t data);
-static int	rtsx_send_cmd(struct rtsx_softc *sc, struct mmc_command *cmd);
-static void	rtsx_send_cmd_nowait(struct rtsx_softc *sc, struct mmc_command *cmd);
+static void	rtsx_send_cmd(struct rtsx_softc *sc);
+static void	rtsx_batch_start(struct rtsx_softc *sc);
+static int	rtsx_batch_flush(struct rtsx_softc *sc);
+static int	rtsx_batch_end(struct rtsx_softc *sc);
+static void	rtsx_req_timeout(void *arg);
+static bool	rtsx_req_claim(struct rtsx_softc *sc, uint32_t status);
+static void	rtsx_req_complete(struct rtsx_softc *sc);
+static void	rtsx_req_release(struct rtsx_softc *sc);
 static void	rtsx_req_done(struct rtsx_softc *sc);
 static void	rtsx_soft_reset(struct rtsx_softc *sc);
-static int	rtsx_send_req_get_resp(struct rtsx_softc *sc, struct mmc_command *cmd);
+static int	rtsx_queue_req(struct rtsx_softc *sc, struct mmc_command *cmd);
+static int	rtsx_send_req(struct rtsx_softc *sc, struct mmc_command *cmd);
+static int	rtsx_resp_len(struct mmc_command *cmd);
+static void	rtsx_get_resp(struct rtsx_softc *sc, int offset);
+static void	rtsx_send_req_done(struct rtsx_softc *sc);
 static int	rtsx_xfer_short(struct rtsx_softc *sc, struct mmc_command *cmd);
-static int	rtsx_read_ppbuf(struct rtsx_softc *sc, struct mmc_command *cmd);
-static int	rtsx_write_ppbuf(struct rtsx_softc *sc, struct mmc_command *cmd);
+static void	rtsx_queue_read_ppbuf(struct rtsx_softc *sc, struct mmc_command *cmd);
+static void	rtsx_read_ppbuf(struct rtsx_softc *sc);
+static void	rtsx_queue_write_ppbuf(struct rtsx_softc *sc, struct mmc_command *cmd);
+static void	rtsx_queue_xfer(struct rtsx_softc *sc, struct mmc_command *cmd, uint32_t len,
+				uint8_t dma_dir, uint8_t tmode, uint8_t cfg2);
+static bool	rtsx_is_block_xfer(struct mmc_command *cmd);
 static int	rtsx_xfer(struct rtsx_softc *sc, struct mmc_command *cmd);
+static void	rtsx_queue_xfer_req(struct rtsx_softc *sc);
+static void	rtsx_xfer_start(struct rtsx_softc *sc);
+static void	rtsx_xfer_finish(struct rtsx_softc *sc);
+static bool	rtsx_cache_lookup(struct rtsx_softc *sc, struct mmc_command *cmd);
+static void	rtsx_cache_insert(struct rtsx_softc *sc, struct mmc_command *cmd);
+static void	rtsx_cache_invalidate(struct rtsx_softc *sc);
+static void	rtsx_profile_lookup(struct rtsx_softc *sc, uint32_t *cid);
+static uint8_t	rtsx_profile_phase(struct rtsx_softc *sc, uint8_t opcode);
+static void	rtsx_profile_save(struct rtsx_softc *sc, uint8_t phase);
+static void	rtsx_tune_req_done(struct mmc_request *req);
+static void	rtsx_tune_phase_done(struct rtsx_softc *sc);
+static int	rtsx_tune_phase(struct rtsx_softc *sc, uint8_t opcode, uint8_t phase);
+static uint8_t	rtsx_search_final_phase(uint32_t phase_map, int *width);
+static int	rtsx_tune_rx(struct rtsx_softc *sc, uint8_t opcode, uint32_t *phase_map);
+static int	rtsx_set_sd30_drive(struct rtsx_softc *sc);
+static int	rtsx_calibrate_drive(struct rtsx_softc *sc, uint8_t opcode);
+static int	rtsx_tune(struct rtsx_softc *sc);
+static void	rtsx_retune_timeout(void *arg);
+static void	rtsx_request_retune(struct rtsx_softc *sc, const char *reason);
+static void	rtsx_speed_error(struct rtsx_softc *sc);
+static void	rtsx_speed_ok(struct rtsx_softc *sc);
+static int	rtsx_speed_apply(struct rtsx_softc *sc);
 
 static int	rtsx_read_ivar(device_t bus, device_t child, int which, uintptr_t *result);
 static int	rtsx_write_ivar(device_t bus, device_t child, int which, uintptr_t value);
@@ -208,13 +402,24 @@ static int	rtsx_resume(device_t dev);
 
 static int	rtsx_mmcbr_update_ios(device_t bus, device_t child __unused);
 static int	rtsx_mmcbr_switch_vccq(device_t bus, device_t child __unused);
-static int	rtsx_mmcbr_tune(device_t bus, device_t child __unused, bool hs400 __unused);
+static int	rtsx_mmcbr_tune(device_t bus, device_t child __unused, bool hs400);
 static int	rtsx_mmcbr_retune(device_t bus, device_t child __unused, bool reset __unused);
 static int	rtsx_mmcbr_request(device_t bus, device_t child __unused, struct mmc_request *req);
 static int	rtsx_mmcbr_get_ro(device_t bus, device_t child __unused);
 static int	rtsx_mmcbr_acquire_host(device_t bus, device_t child __unused);
 static int	rtsx_mmcbr_release_host(device_t bus, device_t child __unused);
 
+/*
+ * The mutex protects rtsx_req, rtsx_req_owner, rtsx_intr_status, the
+ * completion flags, the card present flag and the card state dropped on
+ * removal (caches, profile). The owner of the request encodes commands,
+ * copies data and waits without the mutex. Once rtsx_send_cmd() has run
+ * the command buffer, rtsx_intr() or rtsx_req_timeout() claims its
+ * completion and becomes the owner of the next phase, or leaves it to
+ * rtsx_req_release() if the owner is still busy. The register shadow
+ * is only used by the thread accessing the registers, card removal
+ * flags it through rtsx_shadow_stale.
+ */
 #define	RTSX_LOCK_INIT(_sc)	mtx_init(&(_sc)->rtsx_mtx,	\
 					 device_get_nameunit(sc->rtsx_dev), "rtsx", MTX_DEF)
 #define	RTSX_LOCK(_sc)		mtx_lock(&(_sc)->rtsx_mtx)
@@ -224,17 +429,75 @@ static int	rtsx_mmcbr_release_host(device_t bus, device_t child __unused);
 #define	RTSX_SDCLK_OFF			0
 #define	RTSX_SDCLK_250KHZ	   250000
 #define	RTSX_SDCLK_400KHZ	   400000
+#define	RTSX_SDCLK_1MHZ		  1000000
 #define	RTSX_SDCLK_25MHZ	 25000000
 #define	RTSX_SDCLK_50MHZ	 50000000
 #define	RTSX_SDCLK_100MHZ	100000000
 #define	RTSX_SDCLK_208MHZ	208000000
 
+/* Range of SSC_DIV_N_0. */
+#define	RTSX_MIN_DIV_N		80
+#define	RTSX_MAX_DIV_N		208
+
+/* Phases of the variable phase clock for SDR104, SDR50 and DDR50. */
+#define	RTSX_SET_CLOCK_PHASE(sdr104, sdr50, ddr50)	\
+	(((sdr104) << 16) | ((sdr50) << 8) | (ddr50))
+#define	RTSX_SDR104_PHASE(phase)	(((phase) >> 16) & 0xff)
+#define	RTSX_SDR50_PHASE(phase)		(((phase) >> 8) & 0xff)
+#define	RTSX_DDR50_PHASE(phase)		((phase) & 0xff)
+#define	RTSX_PHASE_MAX		32
+#define	RTSX_RX_TUNING_CNT	3
+#define	RTSX_RETUNE_PERIOD	300
+#define	RTSX_RETUNE_CRC_ERRORS	3
+#define	RTSX_SPEED_ERRORS	4
+#define	RTSX_SPEED_WINDOW	10
+#define	RTSX_SPEED_CLEAN	60
+
+/*
+ * Highest SD clock of each speed fallback level.
+ */
+static const uint32_t rtsx_speed_clock[] = {
+	RTSX_SDCLK_208MHZ,	/* SDR104 */
+	RTSX_SDCLK_100MHZ,	/* SDR50 */
+	RTSX_SDCLK_50MHZ,	/* HS */
+	RTSX_SDCLK_25MHZ,	/* DS */
+};
+
 #define	RTSX_MAX_DATA_BLKLEN	512
 
 #define	RTSX_DMA_ALIGN		4
-#define	RTSX_HOSTCMD_MAX	256
-#define	RTSX_DMA_CMD_BIFSIZE	(sizeof(uint32_t) * RTSX_HOSTCMD_MAX)
+#define	RTSX_HOSTCMD_DEFAULT	1024
+#define	RTSX_HOSTCMD_MIN	1024
+#define	RTSX_BATCH_TRIES	10000
+#define	RTSX_HOSTCMD_LIMIT	(0x00ffffff / sizeof(uint32_t))
+#define	RTSX_DMA_CMD_BIFSIZE(sc) (sizeof(uint32_t) * (sc)->rtsx_hostcmd_max)
+#define	RTSX_CMD_NBUF		2
+#define	RTSX_CMD_BUF(sc, i)	((uint32_t *)(sc)->rtsx_cmd_dmamem + (i) * (sc)->rtsx_hostcmd_max)
 #define	RTSX_DMA_DATA_BUFSIZE	MAXPHYS
+#define	RTSX_ADMA_DESC_SIZE	sizeof(uint64_t)
+#define	RTSX_DMA_ADMA_BUFSIZE	(RTSX_ADMA_DESC_SIZE * SDMMC_MAXNSEGS)
+#define	RTSX_ADMA_MAX_SEGSIZE	0x10000
+#define	RTSX_DMA_MAX_SEGSIZE	0x00ffffff	/* length field of RTSX_HDBCTLR */
+#define	RTSX_CACHE_NENT		64
+#define	RTSX_PROFILE_NENT	16
+#define	RTSX_SCRIPT_NENT	512
+
+/*
+ * Write-through shadow of the clock and card control registers.
+ * Only the registers changed by the driver alone are shadowed,
+ * the status, command and transfer registers are always accessed.
+ */
+static const struct {
+	uint16_t	start;
+	uint16_t	end;
+} rtsx_shadow_ranges[] = {
+	{ RTSX_FPDCTL,		RTSX_OCPCTL },		/* clock, SSC */
+	{ RTSX_OCPGLITCH,	RTSX_CARD_CLK_SOURCE },	/* OCP, LDO, VPCLK */
+	{ RTSX_CARD_PWR_CTL,	RTSX_CARD_DRIVE_SEL },	/* skip RTSX_CARD_STOP */
+	{ RTSX_CARD_OE,		RTSX_CARD_PAD_CTL },
+	{ RTSX_SD_CFG1,		RTSX_SD_CFG2 },		/* skip the SD status */
+	{ RTSX_SD_PAD_CTL,	RTSX_SD_PUSH_POINT_CTL },
+};
 
 #define	ISSET(t, f) ((t) & (f))
 
@@ -277,6 +540,17 @@ static int	rtsx_mmcbr_release_host(device_t bus, device_t child __unused);
 			return (err);				\
 	} while (0)
 
+/* Delay which runs the pending register writes first. */
+#define	RTSX_DELAY(sc, usec)					\
+	do {							\
+		int err;					\
+		if ((sc)->rtsx_script_rec)			\
+			rtsx_script_add((sc), RTSX_SCRIPT_DELAY, 0, 0, (usec)); \
+		if ((err = rtsx_batch_flush(sc)))		\
+			return (err);				\
+		DELAY(usec);					\
+	} while (0)
+
 /* 
  * We use two DMA buffers: a command buffer and a data buffer.
  *
@@ -289,11 +563,18 @@ static int	rtsx_mmcbr_release_host(device_t bus, device_t child __unused);
  * and a data bit-mask and value.
  * SD/MMC commands which do not transfer any data from/to the card only use
  * the command buffer.
+ * The command DMA memory holds two command buffers: while the chip runs
+ * one of them, the next phase of the request is queued into the other.
  *
  * The data buffer is used for transfer longer than 512. Data transfer is
  * controlled via the RTSX_HDBAR register and completion is signalled by
  * the RTSX_TRANS_OK_INT interrupt.
  *
+ * When the ADMA mode is usable, the request buffer is mapped directly and
+ * described to the chip by a table of 8 byte descriptors (address, length
+ * and attributes). RTSX_HDBAR then points to this table instead of the data
+ * buffer, which is only kept as a bounce buffer if the mapping fails.
+ *
  * The chip is unable to perform DMA above 4GB.
  */
 
@@ -306,8 +587,8 @@ rtsx_dma_alloc(struct rtsx_softc *sc) {
 	    BUS_SPACE_MAXADDR_32BIT,	/* lowaddr */
 	    BUS_SPACE_MAXADDR,		/* highaddr */
 	    NULL, NULL,			/* filter, filterarg */
-	    RTSX_DMA_CMD_BIFSIZE, 1,	/* maxsize, nsegments */
-	    RTSX_DMA_CMD_BIFSIZE,	/* maxsegsize */
+	    RTSX_DMA_CMD_BIFSIZE(sc) * RTSX_CMD_NBUF, 1,	/* maxsize, nsegments */
+	    RTSX_DMA_CMD_BIFSIZE(sc) * RTSX_CMD_NBUF,	/* maxsegsize */
 	    0,				/* flags */
 	    NULL, NULL,			/* lockfunc, lockarg */
 	    &sc->rtsx_cmd_dma_tag);
@@ -329,7 +610,7 @@ rtsx_dma_alloc(struct rtsx_softc *sc) {
 	error = bus_dmamap_load(sc->rtsx_cmd_dma_tag,	/* DMA tag */
 	    sc->rtsx_cmd_dmamap,	/* DMA map */
 	    sc->rtsx_cmd_dmamem,	/* KVA pointer to be mapped */
-	    RTSX_DMA_CMD_BIFSIZE,	/* size of buffer */
+	    RTSX_DMA_CMD_BIFSIZE(sc) * RTSX_CMD_NBUF,	/* size of buffer */
 	    rtsx_dmamap_cb,		/* callback */
 	    &sc->rtsx_cmd_buffer,	/* first arg of callback */
 	    0);				/* flags */
@@ -377,8 +658,115 @@ rtsx_dma_alloc(struct rtsx_softc *sc) {
                 error = (error) ? error : EFAULT;
 		goto destroy_data_dmamem_alloc;
         }
+
+	error = bus_dma_tag_create(bus_get_dma_tag(sc->rtsx_dev), /* inherit from parent */
+	    RTSX_ADMA_DESC_SIZE, 0,	/* alignment, boundary */
+	    BUS_SPACE_MAXADDR_32BIT,	/* lowaddr */
+	    BUS_SPACE_MAXADDR,		/* highaddr */
+	    NULL, NULL,			/* filter, filterarg */
+	    RTSX_DMA_ADMA_BUFSIZE, 1,	/* maxsize, nsegments */
+	    RTSX_DMA_ADMA_BUFSIZE,	/* maxsegsize */
+	    0,				/* flags */
+	    NULL, NULL,			/* lockfunc, lockarg */
+	    &sc->rtsx_adma_dma_tag);
+	if (error) {
+                device_printf(sc->rtsx_dev,
+			      "Can't create ADMA parent DMA tag\n");
+		goto destroy_data_dmamap_load;
+	}
+	error = bus_dmamem_alloc(sc->rtsx_adma_dma_tag,		/* DMA tag */
+	    &sc->rtsx_adma_dmamem,				/* will hold the KVA pointer */
+	    BUS_DMA_COHERENT | BUS_DMA_WAITOK | BUS_DMA_ZERO,	/* flags */
+	    &sc->rtsx_adma_dmamap); 				/* DMA map */
+	if (error) {
+                device_printf(sc->rtsx_dev,
+			      "Can't create DMA map for ADMA descriptor table\n");
+		goto destroy_adma_dma_tag;
+	}
+	error = bus_dmamap_load(sc->rtsx_adma_dma_tag,	/* DMA tag */
+	    sc->rtsx_adma_dmamap,	/* DMA map */
+	    sc->rtsx_adma_dmamem,	/* KVA pointer to be mapped */
+	    RTSX_DMA_ADMA_BUFSIZE,	/* size of buffer */
+	    rtsx_dmamap_cb,		/* callback */
+	    &sc->rtsx_adma_buffer,	/* first arg of callback */
+	    0);				/* flags */
+	if (error || sc->rtsx_adma_buffer == 0) {
+                device_printf(sc->rtsx_dev,
+			      "Can't load DMA memory for ADMA descriptor table\n");
+                error = (error) ? error : EFAULT;
+		goto destroy_adma_dmamem_alloc;
+        }
+
+	/*
+	 * The request tags don't restrict the addresses, so that busdma never
+	 * bounces a request buffer: rtsx_req_dmamap_cb() refuses segments
+	 * above 4GB and the data buffer is used instead.
+	 */
+	error = bus_dma_tag_create(bus_get_dma_tag(sc->rtsx_dev), /* inherit from parent */
+	    RTSX_DMA_ALIGN, 0,		/* alignment, boundary */
+	    BUS_SPACE_MAXADDR,		/* lowaddr */
+	    BUS_SPACE_MAXADDR,		/* highaddr */
+	    NULL, NULL,			/* filter, filterarg */
+	    RTSX_DMA_DATA_BUFSIZE,	/* maxsize */
+	    SDMMC_MAXNSEGS,		/* nsegments */
+	    RTSX_ADMA_MAX_SEGSIZE,	/* maxsegsize */
+	    0,				/* flags */
+	    NULL, NULL,			/* lockfunc, lockarg */
+	    &sc->rtsx_req_dma_tag);
+	if (error) {
+                device_printf(sc->rtsx_dev,
+			      "Can't create request parent DMA tag\n");
+		goto destroy_adma_dmamap_load;
+	}
+	error = bus_dmamap_create(sc->rtsx_req_dma_tag,	/* DMA tag */
+	    0,						/* flags */
+	    &sc->rtsx_req_dmamap);			/* DMA map */
+	if (error) {
+                device_printf(sc->rtsx_dev,
+			      "Can't create DMA map for request transfer\n");
+		goto destroy_req_dma_tag;
+	}
+
+	error = bus_dma_tag_create(bus_get_dma_tag(sc->rtsx_dev), /* inherit from parent */
+	    RTSX_DMA_ALIGN, 0,		/* alignment, boundary */
+	    BUS_SPACE_MAXADDR,		/* lowaddr */
+	    BUS_SPACE_MAXADDR,		/* highaddr */
+	    NULL, NULL,			/* filter, filterarg */
+	    RTSX_DMA_DATA_BUFSIZE,	/* maxsize */
+	    1,				/* nsegments */
+	    RTSX_DMA_MAX_SEGSIZE,	/* maxsegsize */
+	    0,				/* flags */
+	    NULL, NULL,			/* lockfunc, lockarg */
+	    &sc->rtsx_req1_dma_tag);
+	if (error) {
+                device_printf(sc->rtsx_dev,
+			      "Can't create contiguous request DMA tag\n");
+		goto destroy_req_dmamap_create;
+	}
+	error = bus_dmamap_create(sc->rtsx_req1_dma_tag,	/* DMA tag */
+	    0,						/* flags */
+	    &sc->rtsx_req1_dmamap);			/* DMA map */
+	if (error) {
+                device_printf(sc->rtsx_dev,
+			      "Can't create DMA map for contiguous request transfer\n");
+		goto destroy_req1_dma_tag;
+	}
 	return (error);
 
+ destroy_req1_dma_tag:
+	bus_dma_tag_destroy(sc->rtsx_req1_dma_tag);
+ destroy_req_dmamap_create:
+	bus_dmamap_destroy(sc->rtsx_req_dma_tag, sc->rtsx_req_dmamap);
+ destroy_req_dma_tag:
+	bus_dma_tag_destroy(sc->rtsx_req_dma_tag);
+ destroy_adma_dmamap_load:
+	bus_dmamap_unload(sc->rtsx_adma_dma_tag, sc->rtsx_adma_dmamap);
+ destroy_adma_dmamem_alloc:
+	bus_dmamem_free(sc->rtsx_adma_dma_tag, sc->rtsx_adma_dmamem, sc->rtsx_adma_dmamap);
+ destroy_adma_dma_tag:
+	bus_dma_tag_destroy(sc->rtsx_adma_dma_tag);
+ destroy_data_dmamap_load:
+	bus_dmamap_unload(sc->rtsx_data_dma_tag, sc->rtsx_data_dmamap);
  destroy_data_dmamem_alloc:
 	bus_dmamem_free(sc->rtsx_data_dma_tag, sc->rtsx_data_dmamem, sc->rtsx_data_dmamap);
  destroy_data_dma_tag:
@@ -403,6 +791,27 @@ rtsx_dmamap_cb(void *arg, bus_dma_segment_t *segs, int nsegs, int error)
         *(bus_addr_t *)arg = segs[0].ds_addr;
 }
 
+static void
+rtsx_req_dmamap_cb(void *arg, bus_dma_segment_t *segs, int nsegs, int error)
+{
+	struct rtsx_softc *sc = arg;
+	int i;
+
+	if (error) {
+		sc->rtsx_req_nsegs = 0;
+		return;
+	}
+	/* The chip is unable to perform DMA above 4GB. */
+	for (i = 0; i < nsegs; i++) {
+		if (segs[i].ds_addr + segs[i].ds_len - 1 > BUS_SPACE_MAXADDR_32BIT) {
+			sc->rtsx_req_nsegs = 0;
+			return;
+		}
+	}
+	memcpy(sc->rtsx_req_segs, segs, nsegs * sizeof(bus_dma_segment_t));
+	sc->rtsx_req_nsegs = nsegs;
+}
+
 static void
 rtsx_dma_free(struct rtsx_softc *sc) {
 
@@ -434,33 +843,137 @@ rtsx_dma_free(struct rtsx_softc *sc) {
                 bus_dma_tag_destroy(sc->rtsx_data_dma_tag);
                 sc->rtsx_data_dma_tag = NULL;
 	}
+	if (sc->rtsx_adma_dma_tag != NULL) {
+		if (sc->rtsx_adma_dmamap != NULL)
+                        bus_dmamap_unload(sc->rtsx_adma_dma_tag,
+					  sc->rtsx_adma_dmamap);
+                if (sc->rtsx_adma_dmamem != NULL)
+                        bus_dmamem_free(sc->rtsx_adma_dma_tag,
+					sc->rtsx_adma_dmamem,
+					sc->rtsx_adma_dmamap);
+		sc->rtsx_adma_dmamap = NULL;
+		sc->rtsx_adma_dmamem = NULL;
+                sc->rtsx_adma_buffer = 0;
+                bus_dma_tag_destroy(sc->rtsx_adma_dma_tag);
+                sc->rtsx_adma_dma_tag = NULL;
+	}
+	if (sc->rtsx_req_dma_tag != NULL) {
+		if (sc->rtsx_req_dmamap != NULL)
+			bus_dmamap_destroy(sc->rtsx_req_dma_tag,
+					   sc->rtsx_req_dmamap);
+		sc->rtsx_req_dmamap = NULL;
+                bus_dma_tag_destroy(sc->rtsx_req_dma_tag);
+                sc->rtsx_req_dma_tag = NULL;
+	}
+	if (sc->rtsx_req1_dma_tag != NULL) {
+		if (sc->rtsx_req1_dmamap != NULL)
+			bus_dmamap_destroy(sc->rtsx_req1_dma_tag,
+					   sc->rtsx_req1_dmamap);
+		sc->rtsx_req1_dmamap = NULL;
+                bus_dma_tag_destroy(sc->rtsx_req1_dma_tag);
+                sc->rtsx_req1_dma_tag = NULL;
+	}
+}
+
+/*
+ * Map the request data buffer for a transfer without bounce buffer.
+ * A contiguous buffer is handed directly to the chip, otherwise the ADMA
+ * descriptor table is filled if ADMA is enabled.
+ * Each descriptor holds the bus address of a segment in its upper 32 bits,
+ * the length of the segment in bits 12-31 and the attributes in bits 0-7.
+ */
+static int
+rtsx_req_dma_load(struct rtsx_softc *sc, struct mmc_command *cmd)
+{
+	uint64_t *desc = (uint64_t *)(sc->rtsx_adma_dmamem);
+	uint8_t attr;
+	int i;
+	int error;
+
+	/* The chip needs 4-byte aligned buffers. */
+	if (((uintptr_t)cmd->data->data & (RTSX_DMA_ALIGN - 1)) ||
+	    (cmd->data->len & (RTSX_DMA_ALIGN - 1)))
+		return (EINVAL);
+
+	sc->rtsx_req_nsegs = 0;
+	sc->rtsx_req_cur_tag = sc->rtsx_req1_dma_tag;
+	sc->rtsx_req_cur_map = sc->rtsx_req1_dmamap;
+	error = bus_dmamap_load(sc->rtsx_req_cur_tag, sc->rtsx_req_cur_map,
+				cmd->data->data, cmd->data->len,
+				rtsx_req_dmamap_cb, sc, BUS_DMA_NOWAIT);
+	if (error == EFBIG && sc->rtsx_adma) {
+		sc->rtsx_req_cur_tag = sc->rtsx_req_dma_tag;
+		sc->rtsx_req_cur_map = sc->rtsx_req_dmamap;
+		error = bus_dmamap_load(sc->rtsx_req_cur_tag, sc->rtsx_req_cur_map,
+					cmd->data->data, cmd->data->len,
+					rtsx_req_dmamap_cb, sc, BUS_DMA_NOWAIT);
+	}
+	if (error)
+		return (error);
+	if (sc->rtsx_req_nsegs == 0) {
+		bus_dmamap_unload(sc->rtsx_req_cur_tag, sc->rtsx_req_cur_map);
+		return (EFAULT);
+	}
+	if (sc->rtsx_req_nsegs == 1)
+		return (0);
+
+	for (i = 0; i < sc->rtsx_req_nsegs; i++) {
+		attr = RTSX_SG_VALID | RTSX_SG_TRANS_DATA;
+		if (i == sc->rtsx_req_nsegs - 1)
+			attr |= RTSX_SG_END;
+		desc[i] = htole64(((uint64_t)sc->rtsx_req_segs[i].ds_addr << 32) |
+				  ((uint64_t)sc->rtsx_req_segs[i].ds_len << 12) | attr);
+	}
+
+	return (0);
 }
 	
-static void
-rtsx_intr(void *arg)
+/*
+ * Interrupt filter: ack the interrupts and hand their status to
+ * rtsx_intr(), which runs the card detection and the request phases.
+ * No phase can be advanced from here: each one either runs the next
+ * command buffer, which takes the softc mutex in rtsx_send_cmd(), or
+ * ends the request, which unloads DMA maps and calls req->done. Both
+ * need a thread context. rtsx_intr() claims a completion without
+ * waiting for the request owner, see rtsx_req_claim().
+ */
+static int
+rtsx_intr_filter(void *arg)
 {
 	struct rtsx_softc *sc = arg;
 	uint32_t enabled, status;
 
-	RTSX_LOCK(sc);
 	enabled = READ4(sc, RTSX_BIER);	/* read Bus Interrupt Enable Register */
 	status = READ4(sc, RTSX_BIPR);	/* read Bus Interrupt Pending Register */
 
-	if (bootverbose)
-		device_printf(sc->rtsx_dev, "Interrupt handler - enabled: %#x, status: %#x\n", enabled, status);
+	if (((enabled & status) == 0) || status == 0xffffffff)
+		return (FILTER_STRAY);
 
-	/* Ack interrupts. */
-	WRITE4(sc, RTSX_BIPR, status);
+	/*
+	 * Ack the enabled interrupts only, rtsx_batch_flush() polls
+	 * the transfer interrupts while they are disabled.
+	 */
+	WRITE4(sc, RTSX_BIPR, enabled & status);
 
-	if (((enabled & status) == 0) || status == 0xffffffff) {
-		device_printf(sc->rtsx_dev, "Spurious interrupt\n");
-		RTSX_UNLOCK(sc);
+	sc->rtsx_read_only = (status & RTSX_SD_WRITE_PROTECT) ? 1 : 0;
+	atomic_set_32(&sc->rtsx_intr_pending, enabled & status);
+
+	return (FILTER_SCHEDULE_THREAD);
+}
+
+static void
+rtsx_intr(void *arg)
+{
+	struct rtsx_softc *sc = arg;
+	uint32_t status;
+	bool claimed;
+
+	status = atomic_readandclear_32(&sc->rtsx_intr_pending);
+	if (status == 0)
 		return;
-	}
-	if (status & RTSX_SD_WRITE_PROTECT)
-		sc->rtsx_read_only = 1;
-	else
-		sc->rtsx_read_only = 0;
+
+	if (bootverbose)
+		device_printf(sc->rtsx_dev, "Interrupt handler - status: %#x\n", status);
 
 	/* start task to handle SD card status change. */
 	/* from dwmmc.c */
@@ -468,55 +981,16 @@ rtsx_intr(void *arg)
 		device_printf(sc->rtsx_dev, "Interrupt card inserted/removed\n");
 		rtsx_handle_card_present(sc);
 	}
-	if (sc->rtsx_req == NULL) {
-		RTSX_UNLOCK(sc);
+	if (!(status & (RTSX_TRANS_OK_INT | RTSX_TRANS_FAIL_INT)))
 		return;
-	}
-	if (status & (RTSX_TRANS_OK_INT | RTSX_TRANS_FAIL_INT)) {
-		sc->rtsx_intr_status |= status;
-		wakeup(&sc->rtsx_intr_status);
-	}
-	RTSX_UNLOCK(sc);
-}
-
-static int
-rtsx_wait_intr(struct rtsx_softc *sc, int mask, int timeout)
-{
-	int status;
-	int error = 0;
-
-	mask |= RTSX_TRANS_FAIL_INT;
-
-	status = sc->rtsx_intr_status & mask;
-	while (status == 0) {
-		if (msleep(&sc->rtsx_intr_status, &sc->rtsx_mtx, 0, "rtsxintr", timeout)
-		    == EWOULDBLOCK) {
-			if (sc->rtsx_req != NULL)
-				device_printf(sc->rtsx_dev, "Controller timeout for CMD%u\n",
-					      sc->rtsx_req->cmd->opcode);
-			else
-				device_printf(sc->rtsx_dev, "Controller timeout!\n");
-			error = MMC_ERR_TIMEOUT;
-			break;
-		}
-		status = sc->rtsx_intr_status & mask;
-	}
 
 	RTSX_LOCK(sc);
-
-	sc->rtsx_intr_status &= ~status;
-
-	/* Has the card disappeared? */
-	if (!ISSET(sc->rtsx_flags, RTSX_F_CARD_PRESENT))
-		error = MMC_ERR_INVALID;
-
-	/* Does transfer fail? */
-	if (error == 0 && (status & RTSX_TRANS_FAIL_INT))
-		error = MMC_ERR_FAILED;
-
+	claimed = rtsx_req_claim(sc, status & (RTSX_TRANS_OK_INT | RTSX_TRANS_FAIL_INT));
 	RTSX_UNLOCK(sc);
-
-	return (error);
+	if (claimed) {
+		rtsx_req_complete(sc);
+		rtsx_req_release(sc);
+	}
 }
 
 /*
@@ -577,6 +1051,24 @@ rtsx_card_task(void *arg, int pending __unused)
 			RTSX_UNLOCK(sc);
 	} else {
 		sc->rtsx_flags &= ~RTSX_F_CARD_PRESENT;
+		sc->rtsx_card_cmd23 = false;
+		sc->rtsx_cmd11 = false;
+		if (sc->rtsx_drive_calibrated) {
+			sc->rtsx_drive_calibrated = false;
+			sc->rtsx_sd30_drive_sel_1v8 = sc->rtsx_sd30_drive_sel_vendor;
+		}
+		sc->rtsx_tuned_clock = 0;
+		if (sc->rtsx_profile != NULL) {
+			sc->rtsx_profile->speed_level = sc->rtsx_speed_level;
+			sc->rtsx_profile = NULL;
+		}
+		sc->rtsx_speed_level = 0;
+		sc->rtsx_speed_errors = 0;
+		sc->rtsx_retune_req = retune_req_none;
+		callout_stop(&sc->rtsx_retune_callout);
+		rtsx_cache_invalidate(sc);
+		/* The shadow belongs to the thread accessing the registers. */
+		atomic_store_rel_int(&sc->rtsx_shadow_stale, 1);
 		/* Card isn't present, detach if necessary. */
 		if (sc->rtsx_mmc_dev != NULL) {
 			if (bootverbose)
@@ -611,6 +1103,9 @@ rtsx_init(struct rtsx_softc *sc)
 	uint8_t version;
 	int error;
 
+	/* The chip may have been reset. */
+	rtsx_shadow_invalidate(sc);
+
 	sc->rtsx_host.host_ocr = RTSX_SUPPORTED_VOLTAGE;
 	sc->rtsx_host.f_min = RTSX_SDCLK_250KHZ;
 	sc->rtsx_host.f_max = RTSX_SDCLK_208MHZ;
@@ -618,7 +1113,11 @@ rtsx_init(struct rtsx_softc *sc)
 	sc->rtsx_host.caps = MMC_CAP_4_BIT_DATA | MMC_CAP_HSPEED |
 		MMC_CAP_UHS_SDR12 | MMC_CAP_UHS_SDR25;
 
-	sc->rtsx_host.caps |= MMC_CAP_UHS_SDR50 | MMC_CAP_UHS_SDR104;
+	sc->rtsx_host.caps |= MMC_CAP_UHS_SDR50 | MMC_CAP_UHS_SDR104 | MMC_CAP_UHS_DDR50;
+	sc->rtsx_host.caps |= MMC_CAP_SIGNALING_180 | MMC_CAP_SIGNALING_330;
+	/* eMMC: HS200 and DDR52 at 1.8V on capable chips, 8 bit bus where the chip has the pins. */
+	if (sc->rtsx_flags & RTSX_F_MMC_HS200)
+		sc->rtsx_host.caps |= MMC_CAP_MMC_HS200_180 | MMC_CAP_MMC_DDR52_180;
 	if (sc->rtsx_flags & RTSX_F_5209)
 		sc->rtsx_host.caps |= MMC_CAP_8_BIT_DATA;
 
@@ -650,10 +1149,12 @@ rtsx_init(struct rtsx_softc *sc)
 		uint32_t reg;
 
 		sc->rtsx_card_drive_sel = RTSX_RTS5209_CARD_DRIVE_DEFAULT;
+		sc->rtsx_sd30_drive_sel_1v8 = RTSX_DRIVER_TYPE_B;
 		sc->rtsx_sd30_drive_sel_3v3 = RTSX_DRIVER_TYPE_D;
 		reg = pci_read_config(sc->rtsx_dev, RTSX_PCR_SETTING_REG2, 4);
 		if (!(reg & 0x80)) {
 			sc->rtsx_card_drive_sel = (reg >> 8) & 0x3F;
+			sc->rtsx_sd30_drive_sel_1v8 = (reg >> 3) & 0x07;
 			sc->rtsx_sd30_drive_sel_3v3 = reg & 0x07;
 //!!!			if (bootverbose)
 			device_printf(sc->rtsx_dev, "card_drive_sel = 0x%02x, sd30_drive_sel_3v3 = 0x%02x\n",
@@ -664,11 +1165,13 @@ rtsx_init(struct rtsx_softc *sc)
 	} else if (sc->rtsx_flags & (RTSX_F_5227 | RTSX_F_522A)) {
 		uint32_t reg;
 
+		sc->rtsx_sd30_drive_sel_1v8 = RTSX_CFG_DRIVER_TYPE_B;
 		sc->rtsx_sd30_drive_sel_3v3 = RTSX_CFG_DRIVER_TYPE_B;
 		reg = pci_read_config(sc->rtsx_dev, RTSX_PCR_SETTING_REG1, 4);
 		if (!(reg & 0x1000000)) {
 			sc->rtsx_card_drive_sel &= 0x3F;
 			sc->rtsx_card_drive_sel |= ((reg >> 25) & 0x01) << 6;
+			sc->rtsx_sd30_drive_sel_1v8 = (reg >> 26) & 0x03;
 			reg = pci_read_config(sc->rtsx_dev, RTSX_PCR_SETTING_REG2, 4);
 			sc->rtsx_sd30_drive_sel_3v3 = (reg >> 5) & 0x03;
 			if (reg & 0x4000)
@@ -684,11 +1187,13 @@ rtsx_init(struct rtsx_softc *sc)
 	} else if (sc->rtsx_flags & RTSX_F_5229) {
 		uint32_t reg;
 
+		sc->rtsx_sd30_drive_sel_1v8 = RTSX_DRIVER_TYPE_B;
 		sc->rtsx_sd30_drive_sel_3v3 = RTSX_DRIVER_TYPE_D;
 		reg = pci_read_config(sc->rtsx_dev, RTSX_PCR_SETTING_REG1, 4);
 		if (!(reg & 0x1000000)) {
 			sc->rtsx_card_drive_sel &= 0x3F;
 			sc->rtsx_card_drive_sel |= ((reg >> 25) & 0x01) << 6;
+			sc->rtsx_sd30_drive_sel_1v8 = rtsx_map_sd_drive((reg >> 26) & 0x03);
 			reg = pci_read_config(sc->rtsx_dev, RTSX_PCR_SETTING_REG2, 4);
 			sc->rtsx_sd30_drive_sel_3v3 = rtsx_map_sd_drive((reg >> 5) & 0x03);
 //!!!			if (bootverbose)
@@ -700,11 +1205,13 @@ rtsx_init(struct rtsx_softc *sc)
 	} else if (sc->rtsx_flags & (RTSX_F_525A | RTSX_F_5249)) {
 		uint32_t reg;
 
+		sc->rtsx_sd30_drive_sel_1v8 = RTSX_CFG_DRIVER_TYPE_B;
 		sc->rtsx_sd30_drive_sel_3v3 = RTSX_CFG_DRIVER_TYPE_B;
 		reg = pci_read_config(sc->rtsx_dev, RTSX_PCR_SETTING_REG1, 4);
 		if ((reg & 0x1000000)) {
 			sc->rtsx_card_drive_sel &= 0x3F;
 			sc->rtsx_card_drive_sel |= ((reg >> 25) & 0x01) << 6;
+			sc->rtsx_sd30_drive_sel_1v8 = (reg >> 26) & 0x03;
 			reg = pci_read_config(sc->rtsx_dev, RTSX_PCR_SETTING_REG2, 4);
 			sc->rtsx_sd30_drive_sel_3v3 = (reg >> 5) & 0x03;
 			if (reg & 0x4000)
@@ -722,11 +1229,13 @@ rtsx_init(struct rtsx_softc *sc)
 		uint8_t  reg3;
 
 		sc->rtsx_card_drive_sel = RTSX_RTL8411_CARD_DRIVE_DEFAULT;
+		sc->rtsx_sd30_drive_sel_1v8 = RTSX_DRIVER_TYPE_B;
 		sc->rtsx_sd30_drive_sel_3v3 = RTSX_DRIVER_TYPE_D;
 		reg1 = pci_read_config(sc->rtsx_dev, RTSX_PCR_SETTING_REG1, 4);
 		if (reg1 & 0x1000000) {
 			sc->rtsx_card_drive_sel &= 0x3F;
 			sc->rtsx_card_drive_sel |= ((reg1 >> 25) & 0x01) << 6;
+			sc->rtsx_sd30_drive_sel_1v8 = rtsx_map_sd_drive((reg1 >> 26) & 0x03);
 			reg3 = pci_read_config(sc->rtsx_dev, RTSX_PCR_SETTING_REG3, 1);
 			sc->rtsx_sd30_drive_sel_3v3 = (reg3 >> 5) & 0x07;
 //!!!			if (bootverbose)
@@ -740,9 +1249,11 @@ rtsx_init(struct rtsx_softc *sc)
 		uint32_t reg;
 
 		sc->rtsx_card_drive_sel = RTSX_RTL8411_CARD_DRIVE_DEFAULT;
+		sc->rtsx_sd30_drive_sel_1v8 = RTSX_DRIVER_TYPE_B;
 		sc->rtsx_sd30_drive_sel_3v3 = RTSX_DRIVER_TYPE_D;
 		reg = pci_read_config(sc->rtsx_dev, RTSX_PCR_SETTING_REG1, 4);
 		if (!(reg & 0x1000000)) {
+			sc->rtsx_sd30_drive_sel_1v8 = rtsx_map_sd_drive((reg >> 26) & 0x03);
 			sc->rtsx_sd30_drive_sel_3v3 = rtsx_map_sd_drive(reg & 0x03);
 //!!!			if (bootverbose)
 			device_printf(sc->rtsx_dev, "sd30_drive_sel_3v3 = 0x%02x\n", sc->rtsx_sd30_drive_sel_3v3);
@@ -751,8 +1262,35 @@ rtsx_init(struct rtsx_softc *sc)
 		}
 	}
 
+	sc->rtsx_sd30_drive_sel_vendor = sc->rtsx_sd30_drive_sel_1v8;
+
+	/* Initial push (TX) and sample (RX) points of SD 3.0 modes, from linux. */
+	if (sc->rtsx_flags & RTSX_F_5209) {
+		sc->rtsx_tx_initial_phase = RTSX_SET_CLOCK_PHASE(27, 27, 16);
+		sc->rtsx_rx_initial_phase = RTSX_SET_CLOCK_PHASE(24, 6, 5);
+	} else if (sc->rtsx_flags & RTSX_F_5227) {
+		sc->rtsx_tx_initial_phase = RTSX_SET_CLOCK_PHASE(27, 27, 15);
+		sc->rtsx_rx_initial_phase = RTSX_SET_CLOCK_PHASE(30, 7, 7);
+	} else if (sc->rtsx_flags & RTSX_F_522A) {
+		sc->rtsx_tx_initial_phase = RTSX_SET_CLOCK_PHASE(20, 20, 11);
+		sc->rtsx_rx_initial_phase = RTSX_SET_CLOCK_PHASE(30, 7, 7);
+	} else if (sc->rtsx_flags & RTSX_F_5229) {
+		sc->rtsx_tx_initial_phase = RTSX_SET_CLOCK_PHASE(27, 27, 15);
+		sc->rtsx_rx_initial_phase = RTSX_SET_CLOCK_PHASE(30, 6, 6);
+	} else if (sc->rtsx_flags & RTSX_F_525A) {
+		sc->rtsx_tx_initial_phase = RTSX_SET_CLOCK_PHASE(25, 29, 11);
+		sc->rtsx_rx_initial_phase = RTSX_SET_CLOCK_PHASE(24, 6, 5);
+	} else if (sc->rtsx_flags & RTSX_F_5249) {
+		sc->rtsx_tx_initial_phase = RTSX_SET_CLOCK_PHASE(1, 29, 16);
+		sc->rtsx_rx_initial_phase = RTSX_SET_CLOCK_PHASE(24, 6, 5);
+	} else {
+		/* RTL8402, RTL8411 and RTL8411B. */
+		sc->rtsx_tx_initial_phase = RTSX_SET_CLOCK_PHASE(23, 7, 14);
+		sc->rtsx_rx_initial_phase = RTSX_SET_CLOCK_PHASE(4, 3, 10);
+	}
+
 	if (bootverbose)
-		device_printf(sc->rtsx_dev, "rtsx_init() rtsx_flags = 0x%04x\n", sc->rtsx_flags);
+		device_printf(sc->rtsx_dev, "rtsx_init() rtsx_flags = 0x%05x\n", sc->rtsx_flags);
 
 	/* Enable interrupt write-clear (default is read-clear). */
 	RTSX_CLR(sc, RTSX_NFTS_TX_CTRL, RTSX_INT_READ_CLR);
@@ -767,7 +1305,7 @@ rtsx_init(struct rtsx_softc *sc)
 
 	/* Power on SSC clock. */
 	RTSX_CLR(sc, RTSX_FPDCTL, RTSX_SSC_POWER_DOWN);
-	DELAY(200);
+	RTSX_DELAY(sc, 200);
 
 	/* Optimize phy. */
 	if (sc->rtsx_flags & RTSX_F_5209) {
@@ -823,7 +1361,7 @@ rtsx_init(struct rtsx_softc *sc)
 					    RTSX_PHY_REV_CLKREQ_DT_1_0 | RTSX_PHY_REV_STOP_CLKRD |
 					    RTSX_PHY_REV_STOP_CLKWR)))
 			return (error);
-		DELAY(10);
+		RTSX_DELAY(sc, 10);
 		if ((error = rtsx_write_phy(sc, RTSX_PHY_BPCR,
 					    RTSX_PHY_BPCR_IBRXSEL | RTSX_PHY_BPCR_IBTXSEL |
 					    RTSX_PHY_BPCR_IB_FILTER | RTSX_PHY_BPCR_CMIRROR_EN)))
@@ -861,6 +1399,25 @@ rtsx_init(struct rtsx_softc *sc)
 			return (error);
 	}
 
+	/* The remaining settings are written as one batch, as linux does. */
+	rtsx_batch_start(sc);
+	error = rtsx_init_batched(sc);
+	if (error == 0)
+		error = rtsx_batch_end(sc);
+	else
+		rtsx_batch_end(sc);
+
+	return (error);
+}
+
+/*
+ * Part of rtsx_init() run in a batch, the caller ends it on any error.
+ */
+static int
+rtsx_init_batched(struct rtsx_softc *sc)
+{
+	int error;
+
 	/* Set mcu_cnt to 7 to ensure data can be sampled properly. */
 	RTSX_SET(sc, RTSX_CLK_DIV, 0x07);
 
@@ -938,7 +1495,7 @@ rtsx_init(struct rtsx_softc *sc)
 		/* Configure OBFF. */
 		RTSX_BITOP(sc, RTSX_OBFF_CFG, RTSX_OBFF_EN_MASK, RTSX_OBFF_ENABLE);
 		/* Configure driving. */
-		if ((error = rtsx_rts5227_fill_driving(sc)))
+		if ((error = rtsx_rts5227_fill_driving(sc, 330)))
 			return (error);
 		/* Configure force_clock_req. */
 		if (sc->rtsx_flags & RTSX_REVERSE_SOCKET)
@@ -981,7 +1538,7 @@ rtsx_init(struct rtsx_softc *sc)
 		/* Configure OBFF. */
 		RTSX_BITOP(sc, RTSX_OBFF_CFG, RTSX_OBFF_EN_MASK, RTSX_OBFF_ENABLE);
 		/* Configure driving. */
-		if ((error = rtsx_rts5227_fill_driving(sc)))
+		if ((error = rtsx_rts5227_fill_driving(sc, 330)))
 			return (error);
 		/* Configure force_clock_req. */
 		if (sc->rtsx_flags & RTSX_REVERSE_SOCKET)
@@ -1011,7 +1568,7 @@ rtsx_init(struct rtsx_softc *sc)
 		/* Set default OLT blink period. */
 		RTSX_BITOP(sc, RTSX_OLT_LED_CTL, 0x0F, RTSX_OLT_LED_PERIOD);
 		/* Configure driving. */
-		if ((error = rtsx_rts5249_fill_driving(sc)))
+		if ((error = rtsx_rts5249_fill_driving(sc, 330)))
 			return (error);
 		/* Configure force_clock_req. */
 		if (sc->rtsx_flags & RTSX_REVERSE_SOCKET)
@@ -1049,7 +1606,7 @@ rtsx_init(struct rtsx_softc *sc)
 		/* Set default OLT blink period. */
 		RTSX_BITOP(sc, RTSX_OLT_LED_CTL, 0x0F, RTSX_OLT_LED_PERIOD);
 		/* Configure driving. */
-		if ((error = rtsx_rts5249_fill_driving(sc)))
+		if ((error = rtsx_rts5249_fill_driving(sc, 330)))
 			return (error);
 		/* Configure force_clock_req. */
 		if (sc->rtsx_flags & RTSX_REVERSE_SOCKET)
@@ -1073,6 +1630,98 @@ rtsx_init(struct rtsx_softc *sc)
 	return (0);
 }
 
+/*
+ * Initialize the chip, recording its register writes in rtsx_script
+ * for rtsx_script_replay().
+ */
+static int
+rtsx_init_record(struct rtsx_softc *sc)
+{
+	int error;
+
+	sc->rtsx_script_len = 0;
+	sc->rtsx_script_rec = (sc->rtsx_script != NULL);
+	error = rtsx_init(sc);
+	/* Recording stops if the script is full. */
+	sc->rtsx_script_init = (error == 0 && sc->rtsx_script_rec) ? sc->rtsx_script_len : 0;
+	sc->rtsx_script_rec = false;
+
+	return (error);
+}
+
+static bool
+rtsx_script_add(struct rtsx_softc *sc, uint8_t op, uint16_t reg, uint8_t mask, uint16_t val)
+{
+	struct rtsx_script *ent;
+
+	if (sc->rtsx_script_len >= RTSX_SCRIPT_NENT) {
+		sc->rtsx_script_rec = false;
+		return (false);
+	}
+	ent = &sc->rtsx_script[sc->rtsx_script_len++];
+	ent->op = op;
+	ent->reg = reg;
+	ent->mask = mask;
+	ent->val = val;
+
+	return (true);
+}
+
+/*
+ * Restore the registers from rtsx_script, batching the writes between
+ * the PHY accesses and the delays, then program the bus width, clock
+ * and timing applied before suspend through their setters.
+ */
+static int
+rtsx_script_replay(struct rtsx_softc *sc)
+{
+	struct rtsx_script *ent;
+	uint32_t status;
+	int error = 0;
+	int i;
+
+	if (sc->rtsx_script_init == 0)
+		return (ENXIO);
+
+	/* The chip has lost its state. */
+	rtsx_shadow_invalidate(sc);
+
+	/* Clear any pending interrupts and enable them, as rtsx_init() does. */
+	status = READ4(sc, RTSX_BIPR);
+	WRITE4(sc, RTSX_BIPR, status);
+	WRITE4(sc, RTSX_BIER,
+	       RTSX_TRANS_OK_INT_EN | RTSX_TRANS_FAIL_INT_EN | RTSX_SD_INT_EN);
+
+	rtsx_batch_start(sc);
+	for (i = 0; i < sc->rtsx_script_len && error == 0; i++) {
+		ent = &sc->rtsx_script[i];
+		switch (ent->op) {
+		case RTSX_SCRIPT_WRITE:
+			error = rtsx_write(sc, ent->reg, ent->mask, ent->val);
+			break;
+		case RTSX_SCRIPT_PHY:
+			error = rtsx_write_phy(sc, ent->reg, ent->val);
+			break;
+		case RTSX_SCRIPT_DELAY:
+			if ((error = rtsx_batch_flush(sc)) == 0)
+				DELAY(ent->val);
+			break;
+		}
+	}
+	if (error == 0 && sc->rtsx_ios_bus_width >= 0)
+		error = rtsx_set_bus_width(sc, sc->rtsx_host.ios.bus_width);
+	if (error == 0 && sc->rtsx_ios_clock >= 0)
+		error = rtsx_set_sd_clock(sc, sc->rtsx_clock_req);
+	if (error == 0 && sc->rtsx_ios_timing >= 0)
+		error = rtsx_set_sd_timing(sc, sc->rtsx_host.ios.timing);
+	if (error == 0)
+		error = rtsx_batch_end(sc);
+	else
+		rtsx_batch_end(sc);
+
+	return (error);
+}
+
 static int
 rtsx_map_sd_drive(int index)
 {
@@ -1086,9 +1735,9 @@ rtsx_map_sd_drive(int index)
 	return (sd_drive[index]);
 }
 
-/* For voltage 3v3. */
+/* For voltage 3v3 or 1v8 (vccq 330 or 180). */
 static int
-rtsx_rts5227_fill_driving(struct rtsx_softc *sc)
+rtsx_rts5227_fill_driving(struct rtsx_softc *sc, int vccq)
 {
 	u_char driving_3v3[4][3] = {
 				    {0x13, 0x13, 0x13},
@@ -1096,16 +1745,28 @@ rtsx_rts5227_fill_driving(struct rtsx_softc *sc)
 				    {0x7F, 0x7F, 0x7F},
 				    {0x96, 0x96, 0x96},
 	};
-	RTSX_WRITE(sc, RTSX_SD30_CLK_DRIVE_SEL, driving_3v3[sc->rtsx_sd30_drive_sel_3v3][0]);
-	RTSX_WRITE(sc, RTSX_SD30_CMD_DRIVE_SEL, driving_3v3[sc->rtsx_sd30_drive_sel_3v3][1]);
-	RTSX_WRITE(sc, RTSX_SD30_DAT_DRIVE_SEL, driving_3v3[sc->rtsx_sd30_drive_sel_3v3][2]);
+	u_char driving_1v8[4][3] = {
+				    {0x99, 0x99, 0x99},
+				    {0xAA, 0xAA, 0xAA},
+				    {0xFE, 0xFE, 0xFE},
+				    {0xB3, 0xB3, 0xB3},
+	};
+	u_char *driving;
+
+	if (vccq == 180)
+		driving = driving_1v8[sc->rtsx_sd30_drive_sel_1v8];
+	else
+		driving = driving_3v3[sc->rtsx_sd30_drive_sel_3v3];
+	RTSX_WRITE(sc, RTSX_SD30_CLK_DRIVE_SEL, driving[0]);
+	RTSX_WRITE(sc, RTSX_SD30_CMD_DRIVE_SEL, driving[1]);
+	RTSX_WRITE(sc, RTSX_SD30_DAT_DRIVE_SEL, driving[2]);
 
 	return (0);
 }
 
-/* For voltage 3v3. */
+/* For voltage 3v3 or 1v8 (vccq 330 or 180). */
 static int
-rtsx_rts5249_fill_driving(struct rtsx_softc *sc)
+rtsx_rts5249_fill_driving(struct rtsx_softc *sc, int vccq)
 {
 	u_char driving_3v3[4][3] = {
 				    {0x11, 0x11, 0x18},
@@ -1113,49 +1774,133 @@ rtsx_rts5249_fill_driving(struct rtsx_softc *sc)
 				    {0xFF, 0xFF, 0xFF},
 				    {0x96, 0x96, 0x96},
 	};
-	RTSX_WRITE(sc, RTSX_SD30_CLK_DRIVE_SEL, driving_3v3[sc->rtsx_sd30_drive_sel_3v3][0]);
-	RTSX_WRITE(sc, RTSX_SD30_CMD_DRIVE_SEL, driving_3v3[sc->rtsx_sd30_drive_sel_3v3][1]);
-	RTSX_WRITE(sc, RTSX_SD30_DAT_DRIVE_SEL, driving_3v3[sc->rtsx_sd30_drive_sel_3v3][2]);
+	u_char driving_1v8[4][3] = {
+				    {0xC4, 0xC4, 0xC4},
+				    {0x3C, 0x3C, 0x3C},
+				    {0xFE, 0xFE, 0xFE},
+				    {0xB3, 0xB3, 0xB3},
+	};
+	u_char *driving;
+
+	if (vccq == 180)
+		driving = driving_1v8[sc->rtsx_sd30_drive_sel_1v8];
+	else
+		driving = driving_3v3[sc->rtsx_sd30_drive_sel_3v3];
+	RTSX_WRITE(sc, RTSX_SD30_CLK_DRIVE_SEL, driving[0]);
+	RTSX_WRITE(sc, RTSX_SD30_CMD_DRIVE_SEL, driving[1]);
+	RTSX_WRITE(sc, RTSX_SD30_DAT_DRIVE_SEL, driving[2]);
 
 	return (0);
 }
 
 static int
-rtsx_read(struct rtsx_softc *sc, uint16_t addr, uint8_t *val)
+rtsx_shadow_index(uint16_t addr)
 {
-	int tries = 1024;
-	uint32_t reg;
-
-	WRITE4(sc, RTSX_HAIMR, RTSX_HAIMR_BUSY |
-	    (uint32_t)((addr & 0x3FFF) << 16));
+	int i;
 
-	while (tries--) {
-		reg = READ4(sc, RTSX_HAIMR);
-		if (!(reg & RTSX_HAIMR_BUSY))
-			break;
+	for (i = 0; i < nitems(rtsx_shadow_ranges); i++) {
+		if (addr >= rtsx_shadow_ranges[i].start && addr <= rtsx_shadow_ranges[i].end)
+			return (addr - RTSX_SHADOW_BASE);
 	}
-	*val = (reg & 0xff);
 
-	return ((tries == 0) ? ETIMEDOUT : 0);
+	return (-1);
 }
 
-static int
-rtsx_read_cfg(struct rtsx_softc *sc, uint8_t func, uint16_t addr, uint32_t *val)
+/*
+ * Return true if the shadow knows that the register holds the bits.
+ */
+static bool
+rtsx_shadow_match(struct rtsx_softc *sc, uint16_t addr, uint8_t mask, uint8_t val)
 {
-	int tries = 1024;
-	uint8_t data0, data1, data2, data3, rwctl;
+	int index;
 
-	RTSX_WRITE(sc, RTSX_CFGADDR0, addr);
-	RTSX_WRITE(sc, RTSX_CFGADDR1, addr >> 8);
-	RTSX_WRITE(sc, RTSX_CFGRWCTL, RTSX_CFG_BUSY | (func & 0x03 << 4));
+	index = rtsx_shadow_index(addr);
+	return (index >= 0 && sc->rtsx_shadow_enable &&
+		(sc->rtsx_shadow_known[index] & mask) == mask &&
+		((sc->rtsx_shadow[index] ^ val) & mask) == 0);
+}
 
-	while (tries--) {
-		RTSX_READ(sc, RTSX_CFGRWCTL, &rwctl);
-		if (!(rwctl & RTSX_CFG_BUSY))
-			break;
-	}
+/*
+ * Forget the shadow, the registers may have been reset.
+ */
+static void
+rtsx_shadow_invalidate(struct rtsx_softc *sc)
+{
 
-	if (tries == 0)
+	memset(sc->rtsx_shadow_known, 0, sizeof(sc->rtsx_shadow_known));
+	memset(sc->rtsx_phy_known, 0, sizeof(sc->rtsx_phy_known));
+}
+
+/*
+ * Forget the shadow if the card has been removed since the last access.
+ * The shadow is only used by the thread accessing the registers, the
+ * card task only flags it.
+ */
+static void
+rtsx_shadow_check(struct rtsx_softc *sc)
+{
+
+	if (sc->rtsx_shadow_stale && atomic_readandclear_int(&sc->rtsx_shadow_stale))
+		rtsx_shadow_invalidate(sc);
+}
+
+static int
+rtsx_read(struct rtsx_softc *sc, uint16_t addr, uint8_t *val)
+{
+	int tries = 1024;
+	uint32_t reg;
+	int index;
+	int error;
+
+	rtsx_shadow_check(sc);
+	index = rtsx_shadow_index(addr);
+	if (index >= 0 && sc->rtsx_shadow_enable && sc->rtsx_shadow_known[index] == 0xff) {
+		sc->rtsx_shadow_read_hits++;
+		*val = sc->rtsx_shadow[index];
+		return (0);
+	}
+
+	/* The pending writes must be done before reading. */
+	if ((error = rtsx_batch_flush(sc)))
+		return (error);
+
+	WRITE4(sc, RTSX_HAIMR, RTSX_HAIMR_BUSY |
+	    (uint32_t)((addr & 0x3FFF) << 16));
+
+	while (tries--) {
+		reg = READ4(sc, RTSX_HAIMR);
+		if (!(reg & RTSX_HAIMR_BUSY))
+			break;
+	}
+	*val = (reg & 0xff);
+	if (tries < 0)
+		return (ETIMEDOUT);
+
+	if (index >= 0) {
+		sc->rtsx_shadow[index] = *val;
+		sc->rtsx_shadow_known[index] = 0xff;
+	}
+
+	return (0);
+}
+
+static int
+rtsx_read_cfg(struct rtsx_softc *sc, uint8_t func, uint16_t addr, uint32_t *val)
+{
+	int tries = 1024;
+	uint8_t data0, data1, data2, data3, rwctl;
+
+	RTSX_WRITE(sc, RTSX_CFGADDR0, addr);
+	RTSX_WRITE(sc, RTSX_CFGADDR1, addr >> 8);
+	RTSX_WRITE(sc, RTSX_CFGRWCTL, RTSX_CFG_BUSY | (func & 0x03 << 4));
+
+	while (tries--) {
+		RTSX_READ(sc, RTSX_CFGRWCTL, &rwctl);
+		if (!(rwctl & RTSX_CFG_BUSY))
+			break;
+	}
+
+	if (tries < 0)
 		return (ETIMEDOUT);
 
 	RTSX_READ(sc, RTSX_CFGDATA0, &data0);
@@ -1173,6 +1918,34 @@ rtsx_write(struct rtsx_softc *sc, uint16_t addr, uint8_t mask, uint8_t val)
 {
 	int tries = 1024;
 	uint32_t reg;
+	int index;
+	int error;
+
+	if (sc->rtsx_script_rec)
+		rtsx_script_add(sc, RTSX_SCRIPT_WRITE, addr, mask, val);
+
+	rtsx_shadow_check(sc);
+	/* Skip the write if the register already holds the bits. */
+	if (rtsx_shadow_match(sc, addr, mask, val)) {
+		sc->rtsx_shadow_write_hits++;
+		return (0);
+	}
+	index = rtsx_shadow_index(addr);
+
+	/* In a batch, queue the write in the command buffer. */
+	if (sc->rtsx_batch) {
+		if (sc->rtsx_cmd_index >= sc->rtsx_hostcmd_max &&
+		    (error = rtsx_batch_flush(sc)))
+			return (error);
+		if (sc->rtsx_batch) {
+			rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, addr, mask, val);
+			if (index >= 0) {
+				sc->rtsx_shadow[index] = (sc->rtsx_shadow[index] & ~mask) | (val & mask);
+				sc->rtsx_shadow_known[index] |= mask;
+			}
+			return (0);
+		}
+	}
 
 	WRITE4(sc, RTSX_HAIMR,
 	    RTSX_HAIMR_BUSY | RTSX_HAIMR_WRITE |
@@ -1182,11 +1955,21 @@ rtsx_write(struct rtsx_softc *sc, uint16_t addr, uint8_t mask, uint8_t val)
 	while (tries--) {
 		reg = READ4(sc, RTSX_HAIMR);
 		if (!(reg & RTSX_HAIMR_BUSY)) {
-			if (val != (reg & 0xff))
+			if (val != (reg & 0xff)) {
+				if (index >= 0)
+					sc->rtsx_shadow_known[index] = 0;
 				return (EIO);
+			}
+			/* The readback only echoes val, keep the masked bits. */
+			if (index >= 0) {
+				sc->rtsx_shadow[index] = (sc->rtsx_shadow[index] & ~mask) | (val & mask);
+				sc->rtsx_shadow_known[index] |= mask;
+			}
 			return (0);
 		}
 	}
+	if (index >= 0)
+		sc->rtsx_shadow_known[index] = 0;
 
 	return (ETIMEDOUT);
 }
@@ -1197,6 +1980,13 @@ rtsx_read_phy(struct rtsx_softc *sc, uint8_t addr, uint16_t *val)
 	int tries = 100000;
 	uint8_t data0, data1, rwctl;
 
+	rtsx_shadow_check(sc);
+	if (addr < RTSX_PHY_NREG && sc->rtsx_shadow_enable && sc->rtsx_phy_known[addr]) {
+		sc->rtsx_shadow_phy_hits++;
+		*val = sc->rtsx_phy_shadow[addr];
+		return (0);
+	}
+
 	RTSX_WRITE(sc, RTSX_PHY_ADDR, addr);
 	RTSX_WRITE(sc, RTSX_PHY_RWCTL, RTSX_PHY_BUSY | RTSX_PHY_READ);
 
@@ -1205,13 +1995,18 @@ rtsx_read_phy(struct rtsx_softc *sc, uint8_t addr, uint16_t *val)
 		if (!(rwctl & RTSX_PHY_BUSY))
 			break;
 	}
-	if (tries == 0)
+	if (tries < 0)
 		return (ETIMEDOUT);
 
 	RTSX_READ(sc, RTSX_PHY_DATA0, &data0);
 	RTSX_READ(sc, RTSX_PHY_DATA1, &data1);
 	*val = data1 << 8 | data0;
 
+	if (addr < RTSX_PHY_NREG) {
+		sc->rtsx_phy_shadow[addr] = *val;
+		sc->rtsx_phy_known[addr] = true;
+	}
+
 	return (0);
 }
 
@@ -1220,29 +2015,148 @@ rtsx_write_phy(struct rtsx_softc *sc, uint8_t addr, uint16_t val)
 {
 	int tries = 100000;
 	uint8_t rwctl;
+	bool rec;
+	int error;
 
-	RTSX_WRITE(sc, RTSX_PHY_DATA0, val);
-	RTSX_WRITE(sc, RTSX_PHY_DATA1, val >> 8);
-	RTSX_WRITE(sc, RTSX_PHY_ADDR, addr);
-	RTSX_WRITE(sc, RTSX_PHY_RWCTL, RTSX_PHY_BUSY | RTSX_PHY_WRITE);
+	/* Record the PHY write, not the register accesses doing it. */
+	rec = sc->rtsx_script_rec;
+	if (rec)
+		rtsx_script_add(sc, RTSX_SCRIPT_PHY, addr, 0, val);
+
+	rtsx_shadow_check(sc);
+	if (addr < RTSX_PHY_NREG) {
+		if (sc->rtsx_shadow_enable && sc->rtsx_phy_known[addr] &&
+		    sc->rtsx_phy_shadow[addr] == val) {
+			sc->rtsx_shadow_phy_hits++;
+			return (0);
+		}
+		sc->rtsx_phy_known[addr] = false;
+	}
+
+	sc->rtsx_script_rec = false;
+	if ((error = rtsx_write(sc, RTSX_PHY_DATA0, 0xff, val)) == 0 &&
+	    (error = rtsx_write(sc, RTSX_PHY_DATA1, 0xff, val >> 8)) == 0 &&
+	    (error = rtsx_write(sc, RTSX_PHY_ADDR, 0xff, addr)) == 0)
+		error = rtsx_write(sc, RTSX_PHY_RWCTL, 0xff, RTSX_PHY_BUSY | RTSX_PHY_WRITE);
+	sc->rtsx_script_rec = rec;
+	if (error)
+		return (error);
 
 	while (tries--) {
 		RTSX_READ(sc, RTSX_PHY_RWCTL, &rwctl);
 		if (!(rwctl & RTSX_PHY_BUSY))
 			break;
 	}
+	if (tries < 0)
+		return (ETIMEDOUT);
+
+	if (addr < RTSX_PHY_NREG) {
+		sc->rtsx_phy_shadow[addr] = val;
+		sc->rtsx_phy_known[addr] = true;
+	}
+
+	return (0);
+}
+
+static int
+rtsx_set_bus_width(struct rtsx_softc *sc, enum mmc_bus_width width)
+{
+	uint32_t bus_width;
+	int error;
+
+	switch (width) {
+	case bus_width_1:
+		bus_width = RTSX_BUS_WIDTH_1;
+		break;
+	case bus_width_4:
+		bus_width = RTSX_BUS_WIDTH_4;
+		break;
+	case bus_width_8:
+		bus_width = RTSX_BUS_WIDTH_8;
+		break;
+	default:
+		return (MMC_ERR_INVALID);
+	}
+	if ((error = rtsx_write(sc, RTSX_SD_CFG1, RTSX_BUS_WIDTH_MASK, bus_width)))
+		return (error);
+
+	if (bootverbose) {
+		char *busw[] = {
+				"1 bit",
+				"4 bits",
+				"8 bits"
+		};
+			device_printf(sc->rtsx_dev, "Setting bus width to %s\n", busw[bus_width]);
+	}
 
-	return ((tries == 0) ? ETIMEDOUT : 0);
+	return (0);
 }
 
 static int
 rtsx_set_sd_timing(struct rtsx_softc *sc, enum mmc_bus_timing timing)
 {
+	uint8_t tx_phase, rx_phase;
+	int error;
 
 	if (bootverbose)
 		device_printf(sc->rtsx_dev, "rtsx_set_sd_timing(%u)\n", timing);
 
+	/* The sample point is back to the initial one. */
+	sc->rtsx_tuned_clock = 0;
+
 	switch (timing) {
+	case bus_timing_mmc_hs200:
+	case bus_timing_uhs_sdr104:
+	case bus_timing_uhs_sdr50:
+		/* from linux: rtsx_pci_sdmmc.c sd_set_timing(). */
+		RTSX_BITOP(sc, RTSX_SD_CFG1, RTSX_SD_MODE_MASK | RTSX_SD_ASYNC_FIFO_NOT_RST,
+			   RTSX_SD30_MODE | RTSX_SD_ASYNC_FIFO_NOT_RST);
+		RTSX_BITOP(sc, RTSX_CLK_CTL, RTSX_CLK_LOW_FREQ, RTSX_CLK_LOW_FREQ);
+		RTSX_BITOP(sc, RTSX_CARD_CLK_SOURCE, 0xff,
+			   RTSX_CRC_VAR_CLK0 | RTSX_SD30_FIX_CLK | RTSX_SAMPLE_VAR_CLK1);
+		RTSX_BITOP(sc, RTSX_CLK_CTL, RTSX_CLK_LOW_FREQ, 0x00);
+
+		/* Use the initial push and sample points of the chip. */
+		if (timing == bus_timing_uhs_sdr104 || timing == bus_timing_mmc_hs200) {
+			tx_phase = RTSX_SDR104_PHASE(sc->rtsx_tx_initial_phase);
+			rx_phase = RTSX_SDR104_PHASE(sc->rtsx_rx_initial_phase);
+		} else {
+			tx_phase = RTSX_SDR50_PHASE(sc->rtsx_tx_initial_phase);
+			rx_phase = RTSX_SDR50_PHASE(sc->rtsx_rx_initial_phase);
+		}
+		if ((error = rtsx_sd_change_phase(sc, tx_phase, false)))
+			return (error);
+		if ((error = rtsx_sd_change_phase(sc, rx_phase, true)))
+			return (error);
+		break;
+	case bus_timing_mmc_ddr52:
+	case bus_timing_uhs_ddr50:
+		/* Data is clocked on both edges, which needs a 4 or 8 bit bus. */
+		if (sc->rtsx_host.ios.bus_width == bus_width_1) {
+			device_printf(sc->rtsx_dev, "DDR mode needs a 4 or 8 bit bus\n");
+			return (EINVAL);
+		}
+		/* from linux: rtsx_pci_sdmmc.c sd_set_timing(). */
+		RTSX_BITOP(sc, RTSX_SD_CFG1, RTSX_SD_MODE_MASK | RTSX_SD_ASYNC_FIFO_NOT_RST,
+			   RTSX_SDDDR_MODE | RTSX_SD_ASYNC_FIFO_NOT_RST);
+		RTSX_BITOP(sc, RTSX_CLK_CTL, RTSX_CLK_LOW_FREQ, RTSX_CLK_LOW_FREQ);
+		RTSX_BITOP(sc, RTSX_CARD_CLK_SOURCE, 0xff,
+			   RTSX_CRC_VAR_CLK0 | RTSX_SD30_FIX_CLK | RTSX_SAMPLE_VAR_CLK1);
+		RTSX_BITOP(sc, RTSX_CLK_CTL, RTSX_CLK_LOW_FREQ, 0x00);
+		RTSX_BITOP(sc, RTSX_SD_PUSH_POINT_CTL,
+			   RTSX_DDR_VAR_TX_CMD_DAT, RTSX_DDR_VAR_TX_CMD_DAT);
+		RTSX_BITOP(sc, RTSX_SD_SAMPLE_POINT_CTL,
+			   RTSX_DDR_VAR_RX_DAT | RTSX_DDR_VAR_RX_CMD,
+			   RTSX_DDR_VAR_RX_DAT | RTSX_DDR_VAR_RX_CMD);
+
+		/* DDR modes are not tuned, the sample point is the initial one. */
+		tx_phase = RTSX_DDR50_PHASE(sc->rtsx_tx_initial_phase);
+		rx_phase = RTSX_DDR50_PHASE(sc->rtsx_rx_initial_phase);
+		if ((error = rtsx_sd_change_phase(sc, tx_phase, false)))
+			return (error);
+		if ((error = rtsx_sd_change_phase(sc, rx_phase, true)))
+			return (error);
+		break;
 	case bus_timing_hs:
 		RTSX_BITOP(sc, RTSX_SD_CFG1, 0x0C, RTSX_SD20_MODE);
 		RTSX_BITOP(sc, RTSX_CLK_CTL, RTSX_CLK_LOW_FREQ, RTSX_CLK_LOW_FREQ);
@@ -1267,14 +2181,67 @@ rtsx_set_sd_timing(struct rtsx_softc *sc, enum mmc_bus_timing timing)
 	return (0);
 }
 
+/*
+ * Convert an SSC clock in MHz to a SSC_DIV_N_0 value and back.
+ * from linux: rtl8411.c rtl8411_conv_clk_and_div_n().
+ */
+static int
+rtsx_clk_to_div_n(struct rtsx_softc *sc, int clk)
+{
+
+	if (sc->rtsx_flags & (RTSX_F_8402 | RTSX_F_8411 | RTSX_F_8411B))
+		return (clk * 4 / 5 - 2);
+	else
+		return (clk - 2);
+}
+
+static int
+rtsx_div_n_to_clk(struct rtsx_softc *sc, int n)
+{
+
+	if (sc->rtsx_flags & (RTSX_F_8402 | RTSX_F_8411 | RTSX_F_8411B))
+		return ((n + 2) * 5 / 4);
+	else
+		return (n + 2);
+}
+
+/*
+ * Compute the SSC_DIV_N_0 value and the CLK_DIV divider giving an
+ * SSC clock of clk MHz: the SSC runs at clk times the divider, which
+ * is raised until SSC_DIV_N_0 is in range.
+ */
+static int
+rtsx_ssc_div_n(struct rtsx_softc *sc, int clk, int *div)
+{
+	int n;
+
+	n = rtsx_clk_to_div_n(sc, clk);
+	*div = RTSX_CLK_DIV_1;
+	while (n < RTSX_MIN_DIV_N && *div < RTSX_CLK_DIV_8) {
+		n = rtsx_clk_to_div_n(sc, rtsx_div_n_to_clk(sc, n) * 2);
+		(*div)++;
+	}
+
+	return (n);
+}
+
 /*
  * Set or change SDCLK frequency or disable the SD clock.
+ * The SSC settings are computed for the highest frequency not above
+ * freq, which is reported back in ios.clock.
  * Return zero on success.
  */
 static int
 rtsx_set_sd_clock(struct rtsx_softc *sc, uint32_t freq)
 {
-	uint8_t n;
+	enum mmc_bus_timing timing = sc->rtsx_host.ios.timing;
+	uint8_t clk_divide;
+	uint8_t ssc_depth;
+	bool double_clk;
+	bool vpclk;
+	uint32_t actual;
+	int clk;
+	int n;
 	int div;
 	int mcu;
 	int error = 0;
@@ -1287,45 +2254,85 @@ rtsx_set_sd_clock(struct rtsx_softc *sc, uint32_t freq)
 		goto done;
 	}
 
-	/* Round down to a supported frequency. */
-	if (freq >= RTSX_SDCLK_50MHZ)
-		freq = RTSX_SDCLK_50MHZ;
-	else if (freq >= RTSX_SDCLK_25MHZ)
-		freq = RTSX_SDCLK_25MHZ;
-	else
-		freq = RTSX_SDCLK_400KHZ;
+	/* Limit of the speed fallback ladder. */
+	if (freq > rtsx_speed_clock[sc->rtsx_speed_level])
+		freq = rtsx_speed_clock[sc->rtsx_speed_level];
+	sc->rtsx_speed_applied = sc->rtsx_speed_level;
 
 	/*
-	 * Configure the clock frequency.
+	 * from linux: rtsx_pci_sdmmc.c sdmmc_set_ios() and rtsx_pcr.c
+	 * rtsx_pci_switch_clock(). In SD 3.0 mode the SD clock is the
+	 * SSC clock and the variable phase clock is used, otherwise the
+	 * SSC clock is twice the SD clock.
 	 */
-	switch (freq) {
-	case RTSX_SDCLK_400KHZ:
-		n = 80; /* minimum */
-		div = RTSX_CLK_DIV_8;
-		mcu = 7;
-		/*!!!*/
-//		RTSX_BITOP(sc, RTSX_SD_CFG1, RTSX_CLK_DIVIDE_MASK, RTSX_CLK_DIVIDE_128);
-		RTSX_CLR(sc, RTSX_SD_CFG1, RTSX_CLK_DIVIDE_MASK);
+	switch (timing) {
+	case bus_timing_mmc_hs200:
+	case bus_timing_uhs_sdr104:
+		vpclk = true;
+		ssc_depth = RTSX_SSC_DEPTH_2M;
 		break;
-	case RTSX_SDCLK_25MHZ:
-		n = 100;
-		div = RTSX_CLK_DIV_4;
-		mcu = 7;
-		RTSX_CLR(sc, RTSX_SD_CFG1, RTSX_CLK_DIVIDE_MASK);
+	case bus_timing_uhs_sdr50:
+		vpclk = true;
+		ssc_depth = RTSX_SSC_DEPTH_1M;
 		break;
-	case RTSX_SDCLK_50MHZ:
-		n = 100;
-		div = RTSX_CLK_DIV_2;
-		mcu = 7;
-		RTSX_CLR(sc, RTSX_SD_CFG1, RTSX_CLK_DIVIDE_MASK);
+	case bus_timing_mmc_ddr52:
+	case bus_timing_uhs_ddr50:
+		vpclk = false;
+		ssc_depth = RTSX_SSC_DEPTH_1M;
 		break;
 	default:
-		error = EINVAL;
-		goto done;
+		vpclk = false;
+		ssc_depth = RTSX_SSC_DEPTH_500K;
+		break;
+	}
+	double_clk = !vpclk;
+
+	/* Compute the SSC clock in MHz, within the SSC range. */
+	clk_divide = RTSX_CLK_DIVIDE_0;
+	clk = freq / 1000000;
+	if (double_clk)
+		clk *= 2;
+	if (clk > rtsx_div_n_to_clk(sc, RTSX_MAX_DIV_N))
+		clk = rtsx_div_n_to_clk(sc, RTSX_MAX_DIV_N);
+	n = rtsx_ssc_div_n(sc, clk, &div);
+	if (freq <= RTSX_SDCLK_1MHZ || clk <= 2 || n < RTSX_MIN_DIV_N) {
+		/* Too slow for the SSC: use about 30 MHz divided by 128. */
+		clk_divide = RTSX_CLK_DIVIDE_128;
+		double_clk = false;
+		clk = 30;
+		n = rtsx_ssc_div_n(sc, clk, &div);
+	}
+	mcu = MIN(125 / clk + 3, 15);
+
+	/* Spread less with the internal divider and the doubled clock. */
+	if (double_clk && ssc_depth > 1)
+		ssc_depth--;
+	if (div > RTSX_CLK_DIV_1) {
+		if (ssc_depth > div - 1)
+			ssc_depth -= div - 1;
+		else
+			ssc_depth = RTSX_SSC_DEPTH_4M;
 	}
 
+	/* Frequency actually obtained. */
+	actual = rtsx_div_n_to_clk(sc, n) * 1000000 >> (div - RTSX_CLK_DIV_1);
+	if (double_clk)
+		actual /= 2;
+	if (clk_divide == RTSX_CLK_DIVIDE_128)
+		actual /= 128;
+
+	if (bootverbose)
+		device_printf(sc->rtsx_dev, "SD clock %u Hz: n = %d, div = %d, mcu = %d, ssc_depth = %d\n",
+			      actual, n, div, mcu, ssc_depth);
+
+	RTSX_BITOP(sc, RTSX_SD_CFG1, RTSX_CLK_DIVIDE_MASK, clk_divide);
+
 	/* Enable SD clock. */
-	error = rtsx_switch_sd_clock(sc, n, div, mcu);
+	error = rtsx_switch_sd_clock(sc, n, div, mcu, ssc_depth, vpclk);
+	if (error == 0) {
+		sc->rtsx_host.ios.clock = actual;
+		sc->rtsx_ios_clock = actual;
+	}
 
  done:
 	return (error);
@@ -1339,30 +2346,72 @@ rtsx_stop_sd_clock(struct rtsx_softc *sc)
 	return (0);
 }
 
+/*
+ * Program the SSC clock. With vpclk, the SD 3.0 mode set by
+ * rtsx_set_sd_timing() is kept and the variable phase clock is reset,
+ * otherwise SD 2.0 mode is enabled.
+ */
 static int
-rtsx_switch_sd_clock(struct rtsx_softc *sc, uint8_t n, int div, int mcu)
+rtsx_switch_sd_clock(struct rtsx_softc *sc, uint8_t n, int div, int mcu,
+		     uint8_t ssc_depth, bool vpclk)
 {
 	/* Enable SD 2.0 mode. */
-	RTSX_CLR(sc, RTSX_SD_CFG1, RTSX_SD_MODE_MASK);
+	if (!vpclk)
+		RTSX_CLR(sc, RTSX_SD_CFG1, RTSX_SD_MODE_MASK);
 
 	RTSX_SET(sc, RTSX_CLK_CTL, RTSX_CLK_LOW_FREQ);
 
-	RTSX_WRITE(sc, RTSX_CARD_CLK_SOURCE,
-		   RTSX_CRC_FIX_CLK | RTSX_SD30_VAR_CLK0 | RTSX_SAMPLE_VAR_CLK1);
-	RTSX_CLR(sc, RTSX_SD_SAMPLE_POINT_CTL, RTSX_SD20_RX_SEL_MASK);
-	RTSX_WRITE(sc, RTSX_SD_PUSH_POINT_CTL, RTSX_SD20_TX_NEG_EDGE);
-	RTSX_WRITE(sc, RTSX_CLK_DIV, (div << 4) | mcu);
-	RTSX_CLR(sc, RTSX_SSC_CTL1, RTSX_RSTB);
-	RTSX_CLR(sc, RTSX_SSC_CTL2, RTSX_SSC_DEPTH_MASK);
-	RTSX_WRITE(sc, RTSX_SSC_DIV_N_0, n);
-	RTSX_SET(sc, RTSX_SSC_CTL1, RTSX_RSTB);
+	if (!vpclk) {
+		RTSX_WRITE(sc, RTSX_CARD_CLK_SOURCE,
+			   RTSX_CRC_FIX_CLK | RTSX_SD30_VAR_CLK0 | RTSX_SAMPLE_VAR_CLK1);
+		RTSX_CLR(sc, RTSX_SD_SAMPLE_POINT_CTL, RTSX_SD20_RX_SEL_MASK);
+		RTSX_WRITE(sc, RTSX_SD_PUSH_POINT_CTL, RTSX_SD20_TX_NEG_EDGE);
+	}
+	/* Don't reset the SSC if it already runs with these settings. */
+	if (!rtsx_shadow_match(sc, RTSX_CLK_DIV, 0xff, (div << 4) | mcu) ||
+	    !rtsx_shadow_match(sc, RTSX_SSC_CTL2, RTSX_SSC_DEPTH_MASK, ssc_depth) ||
+	    !rtsx_shadow_match(sc, RTSX_SSC_DIV_N_0, 0xff, n) ||
+	    !rtsx_shadow_match(sc, RTSX_SSC_CTL1, RTSX_RSTB, RTSX_RSTB)) {
+		RTSX_WRITE(sc, RTSX_CLK_DIV, (div << 4) | mcu);
+		RTSX_CLR(sc, RTSX_SSC_CTL1, RTSX_RSTB);
+		RTSX_BITOP(sc, RTSX_SSC_CTL2, RTSX_SSC_DEPTH_MASK, ssc_depth);
+		RTSX_WRITE(sc, RTSX_SSC_DIV_N_0, n);
+		RTSX_SET(sc, RTSX_SSC_CTL1, RTSX_RSTB);
+		if (vpclk) {
+			RTSX_CLR(sc, RTSX_SD_VPCLK0_CTL, RTSX_PHASE_NOT_RESET);
+			RTSX_SET(sc, RTSX_SD_VPCLK0_CTL, RTSX_PHASE_NOT_RESET);
+		}
 
-	DELAY(200);
+		RTSX_DELAY(sc, 200);
+	}
 
 	RTSX_CLR(sc, RTSX_CLK_CTL, RTSX_CLK_LOW_FREQ);
 	return (0);
 }
 
+/*
+ * Change the push (TX) or sample (RX) point of the variable phase clock.
+ * from linux: rtsx_pci_sdmmc.c sd_change_phase().
+ */
+static int
+rtsx_sd_change_phase(struct rtsx_softc *sc, uint8_t phase, bool rx)
+{
+
+	if (bootverbose)
+		device_printf(sc->rtsx_dev, "rtsx_sd_change_phase(%s, %u)\n",
+			      rx ? "RX" : "TX", phase);
+
+	RTSX_BITOP(sc, RTSX_CLK_CTL, RTSX_CHANGE_CLK, RTSX_CHANGE_CLK);
+	RTSX_BITOP(sc, rx ? RTSX_SD_VPRX_CTL : RTSX_SD_VPTX_CTL,
+		   RTSX_PHASE_SELECT_MASK, phase);
+	RTSX_CLR(sc, RTSX_SD_VPCLK0_CTL, RTSX_PHASE_NOT_RESET);
+	RTSX_SET(sc, RTSX_SD_VPCLK0_CTL, RTSX_PHASE_NOT_RESET);
+	RTSX_BITOP(sc, RTSX_CLK_CTL, RTSX_CHANGE_CLK, 0);
+	RTSX_CLR(sc, RTSX_SD_CFG1, RTSX_SD_ASYNC_FIFO_NOT_RST);
+
+	return (0);
+}
+
 /*
  * Notice that the meaning of RTSX_PWR_GATE_CTRL changes between RTS5209 and
  * RTS5229. In RTS5209 it is a mask of disabled power gates, while in RTS5229
@@ -1385,6 +2434,10 @@ rtsx_bus_power_off(struct rtsx_softc *sc)
 	/* Disable SD output. */
 	RTSX_CLR(sc, RTSX_CARD_OE, RTSX_CARD_OUTPUT_EN);
 
+	/* Next card starts with 3.3V signalling. */
+	if (sc->rtsx_vccq_180 && (error = rtsx_switch_output_voltage(sc, 330)))
+		return (error);
+
 	/* Turn off power. */
 	if (sc->rtsx_flags & RTSX_F_5209) {
 		RTSX_BITOP(sc, RTSX_CARD_PWR_CTL, RTSX_SD_PWR_MASK | RTSX_PMOS_STRG_MASK,
@@ -1506,13 +2559,13 @@ rtsx_bus_power_on(struct rtsx_softc *sc)
 			   RTSX_BPP_POWER_5_PERCENT_ON);
 		RTSX_BITOP(sc, RTSX_LDO_CTL, RTSX_BPP_LDO_POWB,
 			   RTSX_BPP_LDO_SUSPEND);
-		DELAY(150);
+		RTSX_DELAY(sc, 150);
 		RTSX_BITOP(sc, RTSX_CARD_PWR_CTL, RTSX_BPP_POWER_MASK,
 			   RTSX_BPP_POWER_10_PERCENT_ON);
-		DELAY(150);
+		RTSX_DELAY(sc, 150);
 		RTSX_BITOP(sc, RTSX_CARD_PWR_CTL, RTSX_BPP_POWER_MASK,
 			   RTSX_BPP_POWER_15_PERCENT_ON);
-		DELAY(150);
+		RTSX_DELAY(sc, 150);
 		RTSX_BITOP(sc, RTSX_CARD_PWR_CTL, RTSX_BPP_POWER_MASK,
 			   RTSX_BPP_POWER_ON);
 		RTSX_BITOP(sc, RTSX_LDO_CTL, RTSX_BPP_LDO_POWB,
@@ -1528,7 +2581,7 @@ rtsx_bus_power_on(struct rtsx_softc *sc)
 		else
 			RTSX_BITOP(sc, RTSX_PWR_GATE_CTRL, RTSX_LDO3318_PWR_MASK, RTSX_LDO3318_VCC1);
 
-		DELAY(200);
+		RTSX_DELAY(sc, 200);
 
 		/* Full power. */
 		RTSX_BITOP(sc, RTSX_CARD_PWR_CTL, RTSX_SD_PWR_MASK, RTSX_SD_PWR_ON);
@@ -1544,7 +2597,134 @@ rtsx_bus_power_on(struct rtsx_softc *sc)
 	/* Enable SD card output. */
 	RTSX_WRITE(sc, RTSX_CARD_OE, RTSX_SD_OUTPUT_EN);
 
-	DELAY(200);
+	RTSX_DELAY(sc, 200);
+
+	return (0);
+}
+
+/*
+ * Switch the output voltage of the SD pads, vccq is 330 or 180.
+ */
+static int
+rtsx_switch_output_voltage(struct rtsx_softc *sc, int vccq)
+{
+	bool v18 = (vccq == 180);
+	int error;
+
+	if (sc->rtsx_flags & RTSX_F_5209) {
+		RTSX_BITOP(sc, RTSX_SD30_CMD_DRIVE_SEL, RTSX_SD30_DRIVE_SEL_MASK,
+			   v18 ? sc->rtsx_sd30_drive_sel_1v8 : sc->rtsx_sd30_drive_sel_3v3);
+		RTSX_BITOP(sc, RTSX_LDO_CTL,
+			   (RTSX_BPP_ASIC_MASK << RTSX_BPP_SHIFT_5209) | RTSX_BPP_PAD_MASK,
+			   v18 ? (RTSX_BPP_ASIC_1V8 << RTSX_BPP_SHIFT_5209) | RTSX_BPP_PAD_1V8 :
+			   (RTSX_BPP_ASIC_3V3 << RTSX_BPP_SHIFT_5209) | RTSX_BPP_PAD_3V3);
+	} else if (sc->rtsx_flags & RTSX_F_5227) {
+		/*!!!*/
+		if (v18 && (error = rtsx_write_phy(sc, 0x11, 0x3C02)))
+			return (error);
+		if ((error = rtsx_write_phy(sc, 0x08, v18 ? 0x4CA4 : 0x4FE4)))
+			return (error);
+		if ((error = rtsx_rts5227_fill_driving(sc, vccq)))
+			return (error);
+	} else if (sc->rtsx_flags & RTSX_F_5229) {
+		RTSX_BITOP(sc, RTSX_SD30_CMD_DRIVE_SEL, RTSX_SD30_DRIVE_SEL_MASK,
+			   v18 ? sc->rtsx_sd30_drive_sel_1v8 : sc->rtsx_sd30_drive_sel_3v3);
+		if ((error = rtsx_write_phy(sc, 0x08, v18 ? 0x5FE4 : 0x4FE4)))
+			return (error);
+	} else if (sc->rtsx_flags & RTSX_F_522A) {
+		if (v18 && (error = rtsx_write_phy(sc, 0x11, 0x3C02)))
+			return (error);
+		if ((error = rtsx_write_phy(sc, 0x08, v18 ? 0x54A4 : 0x57E4)))
+			return (error);
+		if ((error = rtsx_rts5227_fill_driving(sc, vccq)))
+			return (error);
+	} else if (sc->rtsx_flags & RTSX_F_525A) {
+		RTSX_BITOP(sc, RTSX_LDO_CONFIG2, RTSX_LDO_D3318_MASK,
+			   v18 ? RTSX_LDO_D3318_18V : RTSX_LDO_D3318_33V);
+		RTSX_BITOP(sc, RTSX_SD_PAD_CTL, RTSX_SD_IO_USING_1V8,
+			   v18 ? RTSX_SD_IO_USING_1V8 : 0);
+		if ((error = rtsx_rts5249_fill_driving(sc, vccq)))
+			return (error);
+	} else if (sc->rtsx_flags & RTSX_F_5249) {
+		uint16_t val;
+
+		if ((error = rtsx_read_phy(sc, RTSX_PHY_TUNE, &val)))
+			return (error);
+		if ((error = rtsx_write_phy(sc, RTSX_PHY_TUNE, (val & RTSX_PHY_TUNE_VOLTAGE_MASK) |
+					    (v18 ? RTSX_PHY_TUNE_D18_1V8 : RTSX_PHY_TUNE_VOLTAGE_3V3))))
+			return (error);
+		if ((error = rtsx_rts5249_fill_driving(sc, vccq)))
+			return (error);
+	} else if (sc->rtsx_flags & RTSX_F_8402) {
+		RTSX_BITOP(sc, RTSX_SD30_CMD_DRIVE_SEL, RTSX_SD30_DRIVE_SEL_MASK,
+			   v18 ? sc->rtsx_sd30_drive_sel_1v8 : sc->rtsx_sd30_drive_sel_3v3);
+		RTSX_BITOP(sc, RTSX_LDO_CTL,
+			   (RTSX_BPP_ASIC_MASK << RTSX_BPP_SHIFT_8402) | RTSX_BPP_PAD_MASK,
+			   v18 ? (RTSX_BPP_ASIC_2V0 << RTSX_BPP_SHIFT_8402) | RTSX_BPP_PAD_1V8 :
+			   (RTSX_BPP_ASIC_3V3 << RTSX_BPP_SHIFT_8402) | RTSX_BPP_PAD_3V3);
+	} else if (sc->rtsx_flags & (RTSX_F_8411 | RTSX_F_8411B)) {
+		RTSX_BITOP(sc, RTSX_SD30_CMD_DRIVE_SEL, RTSX_SD30_DRIVE_SEL_MASK,
+			   v18 ? sc->rtsx_sd30_drive_sel_1v8 : sc->rtsx_sd30_drive_sel_3v3);
+		RTSX_BITOP(sc, RTSX_LDO_CTL,
+			   (RTSX_BPP_ASIC_MASK << RTSX_BPP_SHIFT_8411) | RTSX_BPP_PAD_MASK,
+			   v18 ? (RTSX_BPP_ASIC_1V8 << RTSX_BPP_SHIFT_8411) | RTSX_BPP_PAD_1V8 :
+			   (RTSX_BPP_ASIC_3V3 << RTSX_BPP_SHIFT_8411) | RTSX_BPP_PAD_3V3);
+	}
+	sc->rtsx_vccq_180 = v18;
+
+	return (0);
+}
+
+/*
+ * Signal voltage switch sequence of the SD specification, first step:
+ * after the CMD 11 response the card must drive CMD and DAT[3:0] low.
+ * from linux: rtsx_pci_sdmmc.c sd_wait_voltage_stable_1()
+ */
+static int
+rtsx_wait_voltage_stable_1(struct rtsx_softc *sc)
+{
+	uint8_t stat;
+
+	DELAY(1000);
+	RTSX_READ(sc, RTSX_SD_BUS_STAT, &stat);
+	if (stat & (RTSX_SD_CMD_STATUS | RTSX_SD_DAT3_STATUS | RTSX_SD_DAT2_STATUS |
+		    RTSX_SD_DAT1_STATUS | RTSX_SD_DAT0_STATUS)) {
+		device_printf(sc->rtsx_dev, "Voltage switch: bus lines not low (0x%02x)\n", stat);
+		return (EIO);
+	}
+
+	/* Stop toggling the SD clock. */
+	RTSX_WRITE(sc, RTSX_SD_BUS_STAT, RTSX_SD_CLK_FORCE_STOP);
+
+	return (0);
+}
+
+/*
+ * Second step: once 1.8V is stable, toggle the SD clock again
+ * and check the card releases CMD and DAT[3:0].
+ * from linux: rtsx_pci_sdmmc.c sd_wait_voltage_stable_2()
+ */
+static int
+rtsx_wait_voltage_stable_2(struct rtsx_softc *sc)
+{
+	uint8_t mask = RTSX_SD_CMD_STATUS | RTSX_SD_DAT3_STATUS | RTSX_SD_DAT2_STATUS |
+		RTSX_SD_DAT1_STATUS | RTSX_SD_DAT0_STATUS;
+	uint8_t stat;
+
+	/* Wait for the card regulator. */
+	pause("rtsxvs", MAX(hz / 20, 1));
+	RTSX_WRITE(sc, RTSX_SD_BUS_STAT, RTSX_SD_CLK_TOGGLE_EN);
+	/* Wait for the card to drive DAT[3:0] high at 1.8V. */
+	pause("rtsxvs", MAX(hz / 50, 1));
+
+	RTSX_READ(sc, RTSX_SD_BUS_STAT, &stat);
+	if ((stat & mask) != mask) {
+		device_printf(sc->rtsx_dev, "Voltage switch: bus lines not high (0x%02x)\n", stat);
+		RTSX_CLR(sc, RTSX_SD_BUS_STAT, RTSX_SD_CLK_TOGGLE_EN | RTSX_SD_CLK_FORCE_STOP);
+		RTSX_WRITE(sc, RTSX_CARD_CLK_EN, 0);
+		return (EIO);
+	}
+	RTSX_CLR(sc, RTSX_SD_BUS_STAT, RTSX_SD_CLK_TOGGLE_EN | RTSX_SD_CLK_FORCE_STOP);
 
 	return (0);
 }
@@ -1615,12 +2795,11 @@ rtsx_response_type(uint16_t mmc_rsp)
 }
 
 /*
- * Init command buffer with SD command index and argument.
+ * Queue commands to set SD command index and argument.
  */
 static void
 rtsx_init_cmd(struct rtsx_softc *sc, struct mmc_command *cmd)
 {
-	sc->rtsx_cmd_index = 0;
 	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_CMD0,
 		      0xff, RTSX_SD_CMD_START  | cmd->opcode); 
 	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_CMD1,
@@ -1640,10 +2819,18 @@ static void
 rtsx_push_cmd(struct rtsx_softc *sc, uint8_t cmd, uint16_t reg,
 	      uint8_t mask, uint8_t data)
 {
-	KASSERT(sc->rtsx_cmd_index < RTSX_HOSTCMD_MAX,
+	KASSERT(sc->rtsx_cmd_index < sc->rtsx_hostcmd_max,
 		("rtsx: Too many host commands (%d)\n", sc->rtsx_cmd_index));
 
-	uint32_t *cmd_buffer = (uint32_t *)(sc->rtsx_cmd_dmamem);
+	/* The register is written later, forget its shadow. */
+	if (cmd == RTSX_WRITE_REG_CMD) {
+		int index = rtsx_shadow_index(reg);
+
+		if (index >= 0)
+			sc->rtsx_shadow_known[index] = 0;
+	}
+
+	uint32_t *cmd_buffer = RTSX_CMD_BUF(sc, sc->rtsx_cmd_fill);
 	cmd_buffer[sc->rtsx_cmd_index++] =
 		htole32((uint32_t)(cmd & 0x3) << 30) |
 		((uint32_t)(reg & 0x3fff) << 16) |
@@ -1652,64 +2839,299 @@ rtsx_push_cmd(struct rtsx_softc *sc, uint8_t cmd, uint16_t reg,
 }
 
 /*
- * Run the command queue and wait for completion.
+ * Run the command queue and don't wait for completion.
+ * Completion is signalled by rtsx_intr(), which calls the function set
+ * in rtsx_intr_trans_ok to advance the request to its next phase.
+ * Commands pushed afterwards go to the other command buffer, so the
+ * next phase can be prepared while this one is running.
  */
-static int
-rtsx_send_cmd(struct rtsx_softc *sc, struct mmc_command *cmd)
+static void
+rtsx_send_cmd(struct rtsx_softc *sc)
 {
-	int error = 0;
 
 	if (bootverbose)
 		device_printf(sc->rtsx_dev, "rtsx_send_cmd()\n");
 
-	sc->rtsx_intr_status = 0;
-
 	/* Sync command DMA buffer. */
 	bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_PREREAD);
 	bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_PREWRITE);
 
-	/* Tell the chip where the command buffer is and run the commands. */
-	WRITE4(sc, RTSX_HCBAR, (uint32_t)sc->rtsx_cmd_buffer);
+	/* Tell the chip where the command buffer is. */
+	WRITE4(sc, RTSX_HCBAR,
+	       (uint32_t)sc->rtsx_cmd_buffer + sc->rtsx_cmd_fill * RTSX_DMA_CMD_BIFSIZE(sc));
+
+	/*
+	 * Run the commands. Their completion is claimed under the lock,
+	 * the request must not be touched once it is released.
+	 */
+	RTSX_LOCK(sc);
+	sc->rtsx_intr_status = 0;
+	sc->rtsx_cmd_pending = true;
 	WRITE4(sc, RTSX_HCBCTLR,
 	       ((sc->rtsx_cmd_index * 4) & 0x00ffffff) | RTSX_START_CMD | RTSX_HW_AUTO_RSP);
 
-	if ((error = rtsx_wait_intr(sc, RTSX_TRANS_OK_INT, hz * sc->rtsx_timeout)))
-		cmd->error = error;
+	/* Switch to the other command buffer. */
+	sc->rtsx_cmd_run = sc->rtsx_cmd_fill;
+	sc->rtsx_cmd_fill ^= 1;
+	sc->rtsx_cmd_index = 0;
 
-	return (error);
+	/* Arm the request timeout. */
+	callout_reset(&sc->rtsx_timeout_callout, sc->rtsx_timeout * hz,
+		      rtsx_req_timeout, sc);
+	RTSX_UNLOCK(sc);
 }
 
 /*
- * Run the command queue and don't wait for completion.
+ * Register write batching. Between rtsx_batch_start() and rtsx_batch_end()
+ * rtsx_write() queues WRITE_REG commands in the command buffer, which
+ * rtsx_batch_flush() runs with a single submission before a register
+ * read, a delay, or when the buffer is full. The completion is polled
+ * with the transfer interrupts masked, so no command buffer may be running.
  */
 static void
-rtsx_send_cmd_nowait(struct rtsx_softc *sc, struct mmc_command *cmd)
+rtsx_batch_start(struct rtsx_softc *sc)
 {
+	KASSERT(!sc->rtsx_cmd_pending,
+		("rtsx: Batch started with a command running\n"));
 
-	if (bootverbose)
-		device_printf(sc->rtsx_dev, "rtsx_send_cmd_nowait()\n");
+	if (sc->rtsx_batch_enable && sc->rtsx_cmd_index == 0 && !sc->rtsx_cmd_pending)
+		sc->rtsx_batch = true;
+}
 
-	sc->rtsx_intr_status = 0;
-	/* Sync command DMA buffer. */
-	bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_PREREAD);
-	bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_PREWRITE);
+static int
+rtsx_batch_flush(struct rtsx_softc *sc)
+{
+	uint32_t *cmd_buffer;
+	uint32_t bier, status = 0;
+	int count;
+	int tries;
+	int error = 0;
+	int i;
+
+	if (!sc->rtsx_batch || sc->rtsx_cmd_index == 0)
+		return (0);
+	KASSERT(!sc->rtsx_cmd_pending,
+		("rtsx: Batch flushed with a command running\n"));
+	count = sc->rtsx_cmd_index;
+	sc->rtsx_cmd_index = 0;
+
+	/* Never steal the completion of a running command. */
+	if (sc->rtsx_cmd_pending) {
+		tries = -1;
+		goto replay;
+	}
 
-	/* Tell the chip where the command buffer is and run the commands. */
-	WRITE4(sc, RTSX_HCBAR, (uint32_t)sc->rtsx_cmd_buffer);
+	bier = READ4(sc, RTSX_BIER);
+	WRITE4(sc, RTSX_BIER, bier & ~(RTSX_TRANS_OK_INT_EN | RTSX_TRANS_FAIL_INT_EN));
+
+	bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_PREWRITE);
+	WRITE4(sc, RTSX_HCBAR,
+	       (uint32_t)sc->rtsx_cmd_buffer + sc->rtsx_cmd_fill * RTSX_DMA_CMD_BIFSIZE(sc));
 	WRITE4(sc, RTSX_HCBCTLR,
-	       ((sc->rtsx_cmd_index * 4) & 0x00ffffff) | RTSX_START_CMD | RTSX_HW_AUTO_RSP);
+	       ((count * 4) & 0x00ffffff) | RTSX_START_CMD | RTSX_HW_AUTO_RSP);
+	for (tries = RTSX_BATCH_TRIES; tries > 0; tries--) {
+		status = READ4(sc, RTSX_BIPR);
+		if (status & (RTSX_TRANS_OK_INT | RTSX_TRANS_FAIL_INT))
+			break;
+		DELAY(1);
+	}
+	WRITE4(sc, RTSX_BIPR, status & (RTSX_TRANS_OK_INT | RTSX_TRANS_FAIL_INT));
+	WRITE4(sc, RTSX_BIER, bier);
+	bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_POSTWRITE);
+	sc->rtsx_batches++;
+
+	if (tries > 0 && !(status & RTSX_TRANS_FAIL_INT))
+		return (0);
+
+	/* Replay the batch one register at a time to report the failing one. */
+	device_printf(sc->rtsx_dev, "Batch of %d register writes %s\n",
+		      count, (tries > 0) ? "failed" : "timed out");
+	if (tries == 0)
+		WRITE4(sc, RTSX_HCBCTLR, RTSX_STOP_CMD);
+ replay:
+	sc->rtsx_batch = false;
+	rtsx_shadow_invalidate(sc);
+	cmd_buffer = RTSX_CMD_BUF(sc, sc->rtsx_cmd_fill);
+	for (i = 0; i < count; i++) {
+		uint32_t cmd = le32toh(cmd_buffer[i]);
+		uint16_t reg = (cmd >> 16) & 0x3fff;
+
+		if ((error = rtsx_write(sc, reg, (cmd >> 8) & 0xff, cmd & 0xff))) {
+			device_printf(sc->rtsx_dev, "Write to register 0x%04x failed (%d)\n",
+				      reg, error);
+			break;
+		}
+	}
+
+	return (error);
+}
+
+static int
+rtsx_batch_end(struct rtsx_softc *sc)
+{
+	int error;
+
+	error = rtsx_batch_flush(sc);
+	sc->rtsx_batch = false;
+
+	return (error);
+}
+
+/*
+ * Called by the callout, with the lock held, when the controller doesn't
+ * signal completion. The callout is stopped under the lock when the
+ * command buffer completes, so it can't claim a later phase. The lock
+ * is released here and never taken again (CALLOUT_RETURNUNLOCKED).
+ */
+static void
+rtsx_req_timeout(void *arg)
+{
+	struct rtsx_softc *sc = arg;
+	bool claimed;
+
+	/* Without a transfer interrupt, the completion is a timeout. */
+	claimed = rtsx_req_claim(sc, 0);
+	RTSX_UNLOCK(sc);
+	if (claimed) {
+		rtsx_req_complete(sc);
+		rtsx_req_release(sc);
+	}
+}
+
+/*
+ * Claim the completion of the command buffer, with the lock held.
+ * Return true if the caller becomes the owner of the request, false if
+ * there is nothing to complete or if the busy owner will complete it.
+ */
+static bool
+rtsx_req_claim(struct rtsx_softc *sc, uint32_t status)
+{
+
+	mtx_assert(&sc->rtsx_mtx, MA_OWNED);
+
+	if (!sc->rtsx_cmd_pending)
+		return (false);
+	sc->rtsx_cmd_pending = false;
+	callout_stop(&sc->rtsx_timeout_callout);
+	sc->rtsx_intr_status |= status;
+	if (sc->rtsx_req_owner != NULL) {
+		sc->rtsx_req_deferred = true;
+		return (false);
+	}
+	sc->rtsx_req_owner = curthread;
+
+	return (true);
+}
+
+/*
+ * Advance the request to its next phase after a claimed completion.
+ */
+static void
+rtsx_req_complete(struct rtsx_softc *sc)
+{
+	void (*trans_ok)(struct rtsx_softc *sc);
+	uint32_t status;
+	bool present;
+
+	RTSX_LOCK(sc);
+	status = sc->rtsx_intr_status;
+	present = ISSET(sc->rtsx_flags, RTSX_F_CARD_PRESENT);
+	RTSX_UNLOCK(sc);
+
+	trans_ok = sc->rtsx_intr_trans_ok;
+	sc->rtsx_intr_trans_ok = NULL;
+	if (!(status & (RTSX_TRANS_OK_INT | RTSX_TRANS_FAIL_INT))) {
+		device_printf(sc->rtsx_dev, "Controller timeout for CMD%u\n",
+			      sc->rtsx_curcmd->opcode);
+		sc->rtsx_curcmd->error = MMC_ERR_TIMEOUT;
+		rtsx_req_done(sc);
+	} else if (!present) {
+		/* The card has disappeared. */
+		sc->rtsx_curcmd->error = MMC_ERR_INVALID;
+		rtsx_req_done(sc);
+	} else if (status & RTSX_TRANS_FAIL_INT) {
+		sc->rtsx_curcmd->error = MMC_ERR_FAILED;
+		rtsx_req_done(sc);
+	} else if (trans_ok != NULL) {
+		trans_ok(sc);
+	}
 }
 
+/*
+ * The owner is done with the request until its command buffer completes.
+ * Run the completions claimed meanwhile, unless the request has ended.
+ */
+static void
+rtsx_req_release(struct rtsx_softc *sc)
+{
+
+	RTSX_LOCK(sc);
+	while (sc->rtsx_req_owner == curthread && sc->rtsx_req_deferred) {
+		sc->rtsx_req_deferred = false;
+		RTSX_UNLOCK(sc);
+		rtsx_req_complete(sc);
+		RTSX_LOCK(sc);
+	}
+	if (sc->rtsx_req_owner == curthread)
+		sc->rtsx_req_owner = NULL;
+	RTSX_UNLOCK(sc);
+}
+
+/*
+ * Terminate the current request and call its completion function.
+ */
 static void
 rtsx_req_done(struct rtsx_softc *sc)
 {
 	struct mmc_request *req;
+	struct mmc_command *cmd;
+	uint8_t stat1;
+	bool crc = false;
 
 	req = sc->rtsx_req;
-	if (req->cmd->error != MMC_ERR_NONE)
+	cmd = sc->rtsx_curcmd;
+	sc->rtsx_intr_trans_ok = NULL;
+
+	if (cmd->error != MMC_ERR_NONE) {
+		if (cmd->data != NULL && !sc->rtsx_tuning &&
+		    rtsx_read(sc, RTSX_SD_STAT1, &stat1) == 0 &&
+		    (stat1 & RTSX_SD_CRC_ERR)) {
+			device_printf(sc->rtsx_dev, "CRC error\n");
+			cmd->error = MMC_ERR_BADCRC;
+			crc = true;
+		}
 		rtsx_soft_reset(sc);
+	}
+
+	/* Release the request buffer if it is still mapped. */
+	if (sc->rtsx_req_nsegs > 0) {
+		bus_dmamap_sync(sc->rtsx_req_cur_tag, sc->rtsx_req_cur_map,
+				BUS_DMASYNC_POSTREAD | BUS_DMASYNC_POSTWRITE);
+		bus_dmamap_unload(sc->rtsx_req_cur_tag, sc->rtsx_req_cur_map);
+		sc->rtsx_req_nsegs = 0;
+	}
+
+	/* Drop the prepared phase if any. */
+	sc->rtsx_cmd_index = 0;
+	sc->rtsx_req_cmd23 = false;
+
+	RTSX_LOCK(sc);
+	callout_stop(&sc->rtsx_timeout_callout);
+	if (crc && sc->rtsx_tuned_clock != 0 && sc->rtsx_retune_crc_errors > 0 &&
+	    ++sc->rtsx_crc_errors >= sc->rtsx_retune_crc_errors)
+		rtsx_request_retune(sc, "CRC errors");
+	if (cmd->data != NULL && !sc->rtsx_tuning) {
+		if (cmd->error == MMC_ERR_BADCRC || cmd->error == MMC_ERR_TIMEOUT)
+			rtsx_speed_error(sc);
+		else if (cmd->error == MMC_ERR_NONE)
+			rtsx_speed_ok(sc);
+	}
 	sc->rtsx_req = NULL;
+	sc->rtsx_curcmd = NULL;
+	sc->rtsx_req_owner = NULL;
+	sc->rtsx_req_deferred = false;
 	req->done(req);
+	RTSX_UNLOCK(sc);
 }
 
 /*
@@ -1718,7 +3140,8 @@ rtsx_req_done(struct rtsx_softc *sc)
 static void
 rtsx_soft_reset(struct rtsx_softc *sc)
 {
-	device_printf(sc->rtsx_dev, "Soft reset\n");
+	if (!sc->rtsx_tuning)
+		device_printf(sc->rtsx_dev, "Soft reset\n");
 
 	/* Stop command transfer. */
 	WRITE4(sc, RTSX_HCBCTLR, RTSX_STOP_CMD);
@@ -1735,11 +3158,15 @@ rtsx_soft_reset(struct rtsx_softc *sc)
 			 RTSX_SD_STOP|RTSX_SD_CLR_ERR);
 }
 
+/*
+ * Queue a command without data, the response is read back
+ * into the command buffer.
+ */
 static int
-rtsx_send_req_get_resp(struct rtsx_softc *sc, struct mmc_command *cmd) {
+rtsx_queue_req(struct rtsx_softc *sc, struct mmc_command *cmd)
+{
 	uint8_t rsp_type;
 	uint16_t reg;
-	int error = 0;
 
 	/* Convert response type. */
 	rsp_type = rtsx_response_type(cmd->flags & MMC_RSP_MASK);
@@ -1760,6 +3187,13 @@ rtsx_send_req_get_resp(struct rtsx_softc *sc, struct mmc_command *cmd) {
 	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_CFG2,
 		      0xff, rsp_type);
 
+	/* Keep the SD clock toggling for the voltage switch, from linux. */
+	if (sc->rtsx_host.mode == mode_sd && cmd->opcode == SD_VOLTAGE_SWITCH) {
+		rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BUS_STAT,
+			      0xff, RTSX_SD_CLK_TOGGLE_EN);
+		sc->rtsx_cmd11 = true;
+	}
+
 	/* Use the ping-pong buffer (cmd buffer) for commands which do not transfer data. */
 	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_CARD_DATA_SOURCE,
 		      0x01, RTSX_PINGPONG_BUFFER);
@@ -1783,9 +3217,57 @@ rtsx_send_req_get_resp(struct rtsx_softc *sc, struct mmc_command *cmd) {
 	}
 	rtsx_push_cmd(sc, RTSX_READ_REG_CMD, RTSX_SD_STAT1, 0, 0);
 
-	/* Run the command queue and wait for completion. */
-	if ((error = rtsx_send_cmd(sc, cmd)))
+	return (0);
+}
+
+/*
+ * Queue and run a command without data. The caller sets
+ * the function to be called on completion.
+ */
+static int
+rtsx_send_req(struct rtsx_softc *sc, struct mmc_command *cmd)
+{
+	int error;
+
+	sc->rtsx_curcmd = cmd;
+	if ((error = rtsx_queue_req(sc, cmd)))
 		return (error);
+	rtsx_send_cmd(sc);
+
+	return (0);
+}
+
+/*
+ * Number of bytes returned in the command buffer by the commands
+ * queued by rtsx_queue_req().
+ */
+static int
+rtsx_resp_len(struct mmc_command *cmd)
+{
+	uint8_t rsp_type;
+
+	rsp_type = rtsx_response_type(cmd->flags & MMC_RSP_MASK);
+	if (rsp_type == RTSX_SD_RSP_TYPE_R2)
+		return (1 + 16 + 1);
+	else if (rsp_type != RTSX_SD_RSP_TYPE_R0)
+		return (1 + 5 + 1);
+	else
+		return (1 + 1);
+}
+
+/*
+ * Copy the card response of the current command from the
+ * command buffer into the mmc response buffer. The response
+ * starts offset bytes into the command buffer, when the command
+ * has been queued behind other commands returning values.
+ */
+static void
+rtsx_get_resp(struct rtsx_softc *sc, int offset)
+{
+	struct mmc_command *cmd = sc->rtsx_curcmd;
+	uint8_t rsp_type;
+
+	rsp_type = rtsx_response_type(cmd->flags & MMC_RSP_MASK);
 
 	/* Sync command DMA buffer. */
 	bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_POSTREAD);
@@ -1793,7 +3275,7 @@ rtsx_send_req_get_resp(struct rtsx_softc *sc, struct mmc_command *cmd) {
 
 	/* Copy card response into mmc response buffer. */
 	if (ISSET(cmd->flags, MMC_RSP_PRESENT)) {
-		uint32_t *cmd_buffer = (uint32_t *)(sc->rtsx_cmd_dmamem);
+		uint32_t *cmd_buffer = RTSX_CMD_BUF(sc, sc->rtsx_cmd_run);
 
 		if (bootverbose) {
 			device_printf(sc->rtsx_dev, "cmd_buffer: 0x%08x 0x%08x 0x%08x 0x%08x 0x%08x\n",
@@ -1802,7 +3284,7 @@ rtsx_send_req_get_resp(struct rtsx_softc *sc, struct mmc_command *cmd) {
 
 		if (rsp_type == RTSX_SD_RSP_TYPE_R2) {
 			/* First byte is CHECK_REG_CMD return value, skip it. */
-			unsigned char *ptr = (unsigned char *)cmd_buffer + 1;
+			unsigned char *ptr = (unsigned char *)cmd_buffer + offset + 1;
 			int i;
 
 			/*
@@ -1819,25 +3301,43 @@ rtsx_send_req_get_resp(struct rtsx_softc *sc, struct mmc_command *cmd) {
 			 * First byte is CHECK_REG_CMD return value, second
 			 * one is the command op code -- we skip those.
 			 */
-			cmd->resp[0] =
-				((be32toh(cmd_buffer[0]) & 0x0000ffff) << 16) |
-				((be32toh(cmd_buffer[1]) & 0xffff0000) >> 16);
+			cmd->resp[0] = be32dec((unsigned char *)cmd_buffer + offset + 2);
 		}
 
 		if (bootverbose)
 			device_printf(sc->rtsx_dev, "cmd->resp = 0x%08x 0x%08x 0x%08x 0x%08x\n",
 				      cmd->resp[0], cmd->resp[1], cmd->resp[2], cmd->resp[3]);
-		
 	}
-	return (error);
 }
 
+/*
+ * Get the response of a command without data and terminate the request.
+ */
+static void
+rtsx_send_req_done(struct rtsx_softc *sc)
+{
+
+	rtsx_get_resp(sc, 0);
+	if (sc->rtsx_curcmd->opcode == MMC_ALL_SEND_CID &&
+	    sc->rtsx_curcmd->error == MMC_ERR_NONE) {
+		RTSX_LOCK(sc);
+		rtsx_profile_lookup(sc, sc->rtsx_curcmd->resp);
+		RTSX_UNLOCK(sc);
+	}
+	rtsx_req_done(sc);
+}
+
+/*
+ * Use the ping-pong buffer (cmd buffer) for transfer <= 512 bytes.
+ */
 static int
 rtsx_xfer_short(struct rtsx_softc *sc, struct mmc_command *cmd)
 {
 	uint8_t rsp_type;
 	int read;
-	int error = 0;
+	int error;
+
+	sc->rtsx_curcmd = cmd;
 
 	if (cmd->data == NULL || cmd->data->len == 0) {
 		cmd->error = MMC_ERR_INVALID;
@@ -1868,8 +3368,6 @@ rtsx_xfer_short(struct rtsx_softc *sc, struct mmc_command *cmd)
 		return (MMC_ERR_INVALID);
 	}
 
-	read = ISSET(cmd->data->flags, MMC_DATA_READ);
-
 	if (read) {
 		rtsx_init_cmd(sc, cmd);
 
@@ -1898,27 +3396,22 @@ rtsx_xfer_short(struct rtsx_softc *sc, struct mmc_command *cmd)
 		rtsx_push_cmd(sc, RTSX_CHECK_REG_CMD, RTSX_SD_TRANSFER,
 			      RTSX_SD_TRANSFER_END, RTSX_SD_TRANSFER_END);
 
-		/* Run the command queue and wait for completion. */
-		if ((error = rtsx_send_cmd(sc, cmd)))
-			return (error);
-
-		error = rtsx_read_ppbuf(sc, cmd);
+		/* Queue commands to read back the ping-pong buffer. */
+		rtsx_queue_read_ppbuf(sc, cmd);
 
-		if (bootverbose && error == 0 && cmd->opcode == ACMD_SEND_SCR) {
-			uint8_t *ptr = cmd->data->data;
-			device_printf(sc->rtsx_dev, "SCR = 0x%02x%02x%02x%02x%02x%02x%02x%02x\n",
-				      ptr[0], ptr[1], ptr[2], ptr[3],
-				      ptr[4], ptr[5], ptr[6], ptr[7]);
-		}
+		sc->rtsx_intr_trans_ok = rtsx_read_ppbuf;
+		rtsx_send_cmd(sc);
 	} else {
-		if ((error = rtsx_send_req_get_resp(sc, cmd)))
-			return (error);
-
-		if ((error = rtsx_write_ppbuf(sc, cmd)))
+		/*
+		 * Fill the ping-pong buffer, send the command and write
+		 * the ping-pong buffer to the card in one run of the
+		 * command queue. The write register commands don't return
+		 * anything, so the response is at the start of the buffer.
+		 */
+		rtsx_queue_write_ppbuf(sc, cmd);
+		if ((error = rtsx_queue_req(sc, cmd)))
 			return (error);
 
-		sc->rtsx_cmd_index = 0;
-
 		/* Queue commands to configure data transfer size. */
 		rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BYTE_CNT_L,
 			      0xff, (cmd->data->xfer_len & 0xff));
@@ -1929,241 +3422,981 @@ rtsx_xfer_short(struct rtsx_softc *sc, struct mmc_command *cmd)
 		rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BLOCK_CNT_H,
 			      0xff, ((cmd->data->len / cmd->data->xfer_len) >> 8));
 
-		/* from linux: rtsx_pci_sdmmc.c sd_write_data(). */
-		rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_CFG2,
-			      0xff, RTSX_SD_CALCULATE_CRC7 | RTSX_SD_CHECK_CRC16 |
-			      RTSX_SD_NO_WAIT_BUSY_END | RTSX_SD_CHECK_CRC7 | RTSX_SD_RSP_LEN_0);
-	
-		rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_TRANSFER, 0xff,
-			      RTSX_TM_AUTO_WRITE3 | RTSX_SD_TRANSFER_START);
-		rtsx_push_cmd(sc, RTSX_CHECK_REG_CMD, RTSX_SD_TRANSFER,
-			      RTSX_SD_TRANSFER_END, RTSX_SD_TRANSFER_END);
+		/* from linux: rtsx_pci_sdmmc.c sd_write_data(). */
+		rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_CFG2,
+			      0xff, RTSX_SD_CALCULATE_CRC7 | RTSX_SD_CHECK_CRC16 |
+			      RTSX_SD_NO_WAIT_BUSY_END | RTSX_SD_CHECK_CRC7 | RTSX_SD_RSP_LEN_0);
+
+		rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_TRANSFER, 0xff,
+			      RTSX_TM_AUTO_WRITE3 | RTSX_SD_TRANSFER_START);
+		rtsx_push_cmd(sc, RTSX_CHECK_REG_CMD, RTSX_SD_TRANSFER,
+			      RTSX_SD_TRANSFER_END, RTSX_SD_TRANSFER_END);
+
+		sc->rtsx_intr_trans_ok = rtsx_send_req_done;
+		rtsx_send_cmd(sc);
+	}
+
+	return (0);
+}
+
+/*
+ * Queue the reads of the ping-pong buffer.
+ */
+static void
+rtsx_queue_read_ppbuf(struct rtsx_softc *sc, struct mmc_command *cmd)
+{
+	int i;
+
+	for (i = 0; i < cmd->data->len; i++)
+		rtsx_push_cmd(sc, RTSX_READ_REG_CMD, RTSX_PPBUF_BASE2 + i, 0, 0);
+}
+
+/*
+ * Copy the ping-pong buffer read back into the command buffer
+ * and terminate the request.
+ */
+static void
+rtsx_read_ppbuf(struct rtsx_softc *sc)
+{
+	struct mmc_command *cmd = sc->rtsx_curcmd;
+	uint8_t *ptr = cmd->data->data;
+
+	/* Sync command DMA buffer. */
+	bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_POSTREAD);
+	bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_POSTWRITE);
+
+	/* First byte is CHECK_REG_CMD return value, skip it. */
+	memcpy(ptr, (uint8_t *)RTSX_CMD_BUF(sc, sc->rtsx_cmd_run) + 1, cmd->data->len);
+
+	if (sc->rtsx_host.mode == mode_sd && cmd->opcode == ACMD_SEND_SCR) {
+		/* Bit 33 of SCR (CMD_SUPPORT) tells if the card supports CMD 23. */
+		sc->rtsx_card_cmd23 = (ptr[3] & 0x02) != 0;
+		if (bootverbose)
+			device_printf(sc->rtsx_dev, "SCR = 0x%02x%02x%02x%02x%02x%02x%02x%02x\n",
+				      ptr[0], ptr[1], ptr[2], ptr[3],
+				      ptr[4], ptr[5], ptr[6], ptr[7]);
+	}
+
+	rtsx_req_done(sc);
+}
+
+/*
+ * Queue the writes of the ping-pong buffer.
+ */
+static void
+rtsx_queue_write_ppbuf(struct rtsx_softc *sc, struct mmc_command *cmd)
+{
+	uint8_t *ptr = cmd->data->data;
+	int i;
+
+	for (i = 0; i < cmd->data->len; i++)
+		rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_PPBUF_BASE2 + i, 0xff, ptr[i]);
+}
+
+/*
+ * Queue commands to transfer len bytes between the card and the DMA ring buffer.
+ */
+static void
+rtsx_queue_xfer(struct rtsx_softc *sc, struct mmc_command *cmd, uint32_t len,
+		uint8_t dma_dir, uint8_t tmode, uint8_t cfg2)
+{
+	/* Queue commands to configure data transfer size. */
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BYTE_CNT_L,
+		      0xff, (cmd->data->xfer_len & 0xff));
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BYTE_CNT_H,
+		      0xff, (cmd->data->xfer_len >> 8));
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BLOCK_CNT_L,
+		      0xff, ((len / cmd->data->xfer_len) & 0xff));
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BLOCK_CNT_H,
+		      0xff, ((len / cmd->data->xfer_len) >> 8));
+
+	/* Configure DMA controller. */
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_IRQSTAT0,
+		     RTSX_DMA_DONE_INT, RTSX_DMA_DONE_INT);
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_DMATC3,
+		     0xff, len >> 24);
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_DMATC2,
+		     0xff, len >> 16);
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_DMATC1,
+		     0xff, len >> 8);
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_DMATC0,
+		     0xff, len);
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_DMACTL,
+		     RTSX_DMA_EN | RTSX_DMA_DIR | RTSX_DMA_PACK_SIZE_MASK,
+		     RTSX_DMA_EN | dma_dir | RTSX_DMA_512);
+
+	/* Use the DMA ring buffer for commands which transfer data. */
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_CARD_DATA_SOURCE,
+		      0x01, RTSX_RING_BUFFER);
+
+	/* Queue command to set response type. */
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_CFG2,
+		     0xff, cfg2); 
+
+	/* Queue commands to perform SD transfer. */
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_TRANSFER,
+		      0xff, tmode | RTSX_SD_TRANSFER_START);
+	rtsx_push_cmd(sc, RTSX_CHECK_REG_CMD, RTSX_SD_TRANSFER,
+		      RTSX_SD_TRANSFER_END, RTSX_SD_TRANSFER_END);
+}
+
+/*
+ * Block read and write commands use the DMA engine whatever their length,
+ * other data commands of 512 bytes or less use the ping-pong buffer.
+ */
+static bool
+rtsx_is_block_xfer(struct mmc_command *cmd)
+{
+
+	switch (cmd->opcode) {
+	case MMC_READ_SINGLE_BLOCK:
+	case MMC_READ_MULTIPLE_BLOCK:
+	case MMC_WRITE_BLOCK:
+	case MMC_WRITE_MULTIPLE_BLOCK:
+		return (true);
+	default:
+		return (false);
+	}
+}
+
+/*
+ * Use the DMA engine for block transfers and transfer > 512 bytes.
+ */
+static int
+rtsx_xfer(struct rtsx_softc *sc, struct mmc_command *cmd)
+{
+	int read = ISSET(cmd->data->flags, MMC_DATA_READ);
+
+	sc->rtsx_curcmd = cmd;
+
+	if (cmd->data->xfer_len == 0)
+		cmd->data->xfer_len = (cmd->data->len > RTSX_MAX_DATA_BLKLEN) ?
+			RTSX_MAX_DATA_BLKLEN : cmd->data->len;
+
+	if (bootverbose)
+		device_printf(sc->rtsx_dev, "rtsx_xfer() - %s xfer: %ld bytes with block size %ld\n",
+			      read ? "Read" : "Write",
+			      (unsigned long)cmd->data->len, (unsigned long)cmd->data->xfer_len);
+
+	if (cmd->data->len > RTSX_DMA_DATA_BUFSIZE) {
+		device_printf(sc->rtsx_dev, "rtsx_xfer() length too large: %ld > %d\n",
+			      (unsigned long)cmd->data->len, RTSX_DMA_DATA_BUFSIZE);
+		cmd->error = MMC_ERR_INVALID;
+		return (MMC_ERR_INVALID);
+	}
+
+	/*
+	 * If the card supports it, send CMD 23 before a multiple block
+	 * transfer instead of terminating it with CMD 12. The mmc bus
+	 * doesn't know about CMD 23, so req->stop is just not sent.
+	 */
+	if (sc->rtsx_cmd23 && sc->rtsx_card_cmd23 && sc->rtsx_req->stop != NULL &&
+	    (cmd->opcode == MMC_READ_MULTIPLE_BLOCK ||
+	     cmd->opcode == MMC_WRITE_MULTIPLE_BLOCK)) {
+		sc->rtsx_xfer_cmd23++;
+		sc->rtsx_req_cmd23 = true;
+		memset(&sc->rtsx_sbc, 0, sizeof(sc->rtsx_sbc));
+		sc->rtsx_sbc.opcode = MMC_SET_BLOCK_COUNT;
+		sc->rtsx_sbc.arg = cmd->data->len / cmd->data->xfer_len;
+		sc->rtsx_sbc.flags = MMC_RSP_R1 | MMC_CMD_AC;
+	}
+
+	/* Map the request buffer, otherwise use the bounce buffer. */
+	(void)rtsx_req_dma_load(sc, cmd);
+
+	rtsx_xfer_start(sc);
+
+	return (0);
+}
+
+/*
+ * Queue the data transfer of the current request.
+ */
+static void
+rtsx_queue_xfer_req(struct rtsx_softc *sc)
+{
+	struct mmc_request *req = sc->rtsx_req;
+	struct mmc_command *cmd = req->cmd;
+	uint16_t reg;
+	uint8_t cfg2;
+	int read = ISSET(cmd->data->flags, MMC_DATA_READ);
+	int dma_dir;
+	int tmode;
+
+	/* Configure DMA transfer mode parameters. */
+	cfg2 = RTSX_SD_CHECK_CRC16 | RTSX_SD_RSP_LEN_6 |
+		RTSX_SD_CALCULATE_CRC7 | RTSX_SD_CHECK_CRC7;
+	if (read) {
+		dma_dir = RTSX_DMA_DIR_FROM_CARD;
+		/*
+		 * Use transfer mode AUTO_READ1, which assume we not
+		 * already send the read command and don't need to send
+		 * CMD 12 manually after read.
+		 * A single block read or a read preceded by CMD 23 doesn't
+		 * need CMD 12: use AUTO_READ2.
+		 */
+		if (cmd->opcode == MMC_READ_MULTIPLE_BLOCK && !sc->rtsx_req_cmd23)
+			tmode = RTSX_TM_AUTO_READ1;
+		else
+			tmode = RTSX_TM_AUTO_READ2;
+		cfg2 |= RTSX_SD_NO_WAIT_BUSY_END;
+	} else {
+		dma_dir = RTSX_DMA_DIR_TO_CARD;
+		/*
+		 * Use transfer mode AUTO_WRITE1, which sends the write
+		 * command, the data and CMD 12, waiting for the card to
+		 * leave the busy state as for a R1b response.
+		 * Without CMD 12 or with CMD 23 use AUTO_WRITE2, which
+		 * only sends the write command and the data.
+		 */
+		if (req->stop != NULL && !sc->rtsx_req_cmd23) {
+			tmode = RTSX_TM_AUTO_WRITE1;
+			cfg2 |= RTSX_SD_WAIT_BUSY_END;
+		} else {
+			tmode = RTSX_TM_AUTO_WRITE2;
+			cfg2 |= RTSX_SD_NO_WAIT_BUSY_END;
+		}
+	}
+
+	/* Queue commands to perform the data transfer. */
+	if (sc->rtsx_req_cmd23)
+		(void)rtsx_queue_req(sc, &sc->rtsx_sbc);
+	rtsx_init_cmd(sc, cmd);
+	rtsx_queue_xfer(sc, cmd, cmd->data->len, dma_dir, tmode, cfg2);
+
+	/* Queue commands to read back the last card response of a write. */
+	if (!read)
+		for (reg = RTSX_SD_CMD0; reg <= RTSX_SD_CMD4; reg++)
+			rtsx_push_cmd(sc, RTSX_READ_REG_CMD, reg, 0, 0);
+}
+
+/*
+ * Run the command queue with the data transfer of the current request,
+ * queuing it unless it has been prepared, and start the DMA transfer.
+ */
+static void
+rtsx_xfer_start(struct rtsx_softc *sc)
+{
+	struct mmc_request *req = sc->rtsx_req;
+	struct mmc_command *cmd = req->cmd;
+	int read = ISSET(cmd->data->flags, MMC_DATA_READ);
+
+	sc->rtsx_curcmd = cmd;
+
+	/* Run the command queue. */
+	if (sc->rtsx_cmd_index == 0)
+		rtsx_queue_xfer_req(sc);
+	sc->rtsx_intr_trans_ok = rtsx_xfer_finish;
+	rtsx_send_cmd(sc);
+
+	if (sc->rtsx_req_nsegs > 0) {
+		/* Sync request buffer. */
+		bus_dmamap_sync(sc->rtsx_req_cur_tag, sc->rtsx_req_cur_map,
+				read ? BUS_DMASYNC_PREREAD : BUS_DMASYNC_PREWRITE);
+	}
+	if (sc->rtsx_req_nsegs == 1) {
+		sc->rtsx_xfer_direct++;
+
+		/* Tell the chip where the request buffer is and run the transfer. */
+		WRITE4(sc, RTSX_HDBAR, sc->rtsx_req_segs[0].ds_addr);
+		WRITE4(sc, RTSX_HDBCTLR, RTSX_TRIG_DMA | (read ? RTSX_DMA_READ : 0) |
+		       (cmd->data->len & 0x00ffffff));
+	} else if (sc->rtsx_req_nsegs > 1) {
+		sc->rtsx_xfer_adma++;
+
+		/* Sync descriptor table. */
+		bus_dmamap_sync(sc->rtsx_adma_dma_tag, sc->rtsx_adma_dmamap, BUS_DMASYNC_PREWRITE);
+
+		/* Tell the chip where the descriptor table is and run the transfer. */
+		WRITE4(sc, RTSX_HDBAR, sc->rtsx_adma_buffer);
+		WRITE4(sc, RTSX_HDBCTLR, RTSX_TRIG_DMA | (read ? RTSX_DMA_READ : 0) |
+		       RTSX_ADMA_MODE);
+	} else {
+		sc->rtsx_xfer_bounce++;
+
+		if (!read)
+			memcpy(sc->rtsx_data_dmamem, cmd->data->data, cmd->data->len);
+
+		/* Sync data DMA buffer. */
+		bus_dmamap_sync(sc->rtsx_data_dma_tag, sc->rtsx_data_dmamap, BUS_DMASYNC_PREREAD);
+		bus_dmamap_sync(sc->rtsx_data_dma_tag, sc->rtsx_data_dmamap, BUS_DMASYNC_PREWRITE);
+
+		/* Tell the chip where the data buffer is and run the transfer. */
+		WRITE4(sc, RTSX_HDBAR, sc->rtsx_data_buffer);
+		WRITE4(sc, RTSX_HDBCTLR, RTSX_TRIG_DMA | (read ? RTSX_DMA_READ : 0) |
+		       (cmd->data->len & 0x00ffffff));
+	}
+}
+
+/*
+ * Complete the data transfer of the current request and terminate it.
+ */
+static void
+rtsx_xfer_finish(struct rtsx_softc *sc)
+{
+	struct mmc_command *cmd = sc->rtsx_req->cmd;
+	int read = ISSET(cmd->data->flags, MMC_DATA_READ);
+
+	if (sc->rtsx_req_nsegs > 0) {
+		/* Sync and release request buffer. */
+		if (sc->rtsx_req_nsegs > 1)
+			bus_dmamap_sync(sc->rtsx_adma_dma_tag, sc->rtsx_adma_dmamap,
+					BUS_DMASYNC_POSTWRITE);
+		bus_dmamap_sync(sc->rtsx_req_cur_tag, sc->rtsx_req_cur_map,
+				read ? BUS_DMASYNC_POSTREAD : BUS_DMASYNC_POSTWRITE);
+		bus_dmamap_unload(sc->rtsx_req_cur_tag, sc->rtsx_req_cur_map);
+		sc->rtsx_req_nsegs = 0;
+	} else {
+		/* Sync data DMA buffer. */
+		bus_dmamap_sync(sc->rtsx_data_dma_tag, sc->rtsx_data_dmamap, BUS_DMASYNC_POSTREAD);
+		bus_dmamap_sync(sc->rtsx_data_dma_tag, sc->rtsx_data_dmamap, BUS_DMASYNC_POSTWRITE);
+
+		if (read)
+			memcpy(cmd->data->data, sc->rtsx_data_dmamem, cmd->data->len);
+	}
+
+	/* The card may have been removed while the data was copied. */
+	if (read && cmd->opcode == MMC_READ_SINGLE_BLOCK) {
+		RTSX_LOCK(sc);
+		if (ISSET(sc->rtsx_flags, RTSX_F_CARD_PRESENT))
+			rtsx_cache_insert(sc, cmd);
+		RTSX_UNLOCK(sc);
+	}
+
+	/*
+	 * After a write the SD_CMDx registers hold the response
+	 * of the last command sent, CMD 12 with AUTO_WRITE1.
+	 */
+	if (!read && sc->rtsx_req_cmd23) {
+		rtsx_get_resp(sc, rtsx_resp_len(&sc->rtsx_sbc));
+	} else if (!read) {
+		sc->rtsx_curcmd = (sc->rtsx_req->stop != NULL) ? sc->rtsx_req->stop : cmd;
+		rtsx_get_resp(sc, 0);
+	}
+
+	rtsx_req_done(sc);
+}
+
+/*
+ * Look for a single block read in the sector cache
+ * and copy the sector into the request buffer if found.
+ */
+static bool
+rtsx_cache_lookup(struct rtsx_softc *sc, struct mmc_command *cmd)
+{
+	struct rtsx_cache_entry *ent;
+	int i;
+
+	if (!sc->rtsx_cache_enable || cmd->opcode != MMC_READ_SINGLE_BLOCK ||
+	    cmd->data->len != MMC_SECTOR_SIZE)
+		return (false);
+
+	for (i = 0; i < RTSX_CACHE_NENT; i++) {
+		ent = &sc->rtsx_cache[i];
+		if (ent->lru != 0 && ent->arg == cmd->arg) {
+			ent->lru = ++sc->rtsx_cache_clock;
+			memcpy(cmd->data->data, ent->data, MMC_SECTOR_SIZE);
+			sc->rtsx_cache_hits++;
+			return (true);
+		}
+	}
+	sc->rtsx_cache_misses++;
+
+	return (false);
+}
+
+/*
+ * Store the sector of a completed single block read in the sector
+ * cache, replacing the least recently used entry.
+ */
+static void
+rtsx_cache_insert(struct rtsx_softc *sc, struct mmc_command *cmd)
+{
+	struct rtsx_cache_entry *ent;
+	int i;
+
+	if (!sc->rtsx_cache_enable || cmd->data->len != MMC_SECTOR_SIZE)
+		return;
+
+	ent = &sc->rtsx_cache[0];
+	for (i = 0; i < RTSX_CACHE_NENT; i++) {
+		if (sc->rtsx_cache[i].lru != 0 && sc->rtsx_cache[i].arg == cmd->arg) {
+			ent = &sc->rtsx_cache[i];
+			break;
+		}
+		if (sc->rtsx_cache[i].lru < ent->lru)
+			ent = &sc->rtsx_cache[i];
+	}
+	ent->lru = ++sc->rtsx_cache_clock;
+	ent->arg = cmd->arg;
+	memcpy(ent->data, cmd->data->data, MMC_SECTOR_SIZE);
+}
+
+/*
+ * Drop all the entries of the sector cache.
+ */
+static void
+rtsx_cache_invalidate(struct rtsx_softc *sc)
+{
+	int i;
+
+	for (i = 0; i < RTSX_CACHE_NENT; i++)
+		sc->rtsx_cache[i].lru = 0;
+}
+
+/*
+ * A card has sent its CID: find its profile, or replace the least
+ * recently used one, and apply the drive strength and speed level
+ * which worked last time.
+ */
+static void
+rtsx_profile_lookup(struct rtsx_softc *sc, uint32_t *cid)
+{
+	struct rtsx_profile *p;
+	int i;
+
+	sc->rtsx_profile = NULL;
+	if (!sc->rtsx_profile_enable)
+		return;
+
+	p = &sc->rtsx_profiles[0];
+	for (i = 0; i < RTSX_PROFILE_NENT; i++) {
+		if (sc->rtsx_profiles[i].lru != 0 &&
+		    memcmp(sc->rtsx_profiles[i].cid, cid, sizeof(p->cid)) == 0) {
+			p = &sc->rtsx_profiles[i];
+			break;
+		}
+		if (sc->rtsx_profiles[i].lru < p->lru)
+			p = &sc->rtsx_profiles[i];
+	}
+	if (i == RTSX_PROFILE_NENT) {
+		memset(p, 0, sizeof(*p));
+		memcpy(p->cid, cid, sizeof(p->cid));
+		p->rx_phase = 0xff;
+	} else {
+		if (bootverbose)
+			device_printf(sc->rtsx_dev, "Known card: RX phase %u at %u Hz, speed level %d\n",
+				      p->rx_phase, p->clock, p->speed_level);
+		sc->rtsx_speed_level = p->speed_level;
+		if (p->drive_calibrated) {
+			sc->rtsx_sd30_drive_sel_1v8 = p->drive_sel;
+			sc->rtsx_drive_calibrated = true;
+			(void)rtsx_set_sd30_drive(sc);
+		}
+	}
+	p->lru = ++sc->rtsx_profile_clock;
+	sc->rtsx_profile = p;
+}
+
+/*
+ * Check the sample point of the profile, and its neighbours, in the
+ * timing mode and at the clock it was tuned for. Return the phase,
+ * or 0xff if a full tuning is needed. Called without the lock, which
+ * is only taken to access the profile.
+ */
+static uint8_t
+rtsx_profile_phase(struct rtsx_softc *sc, uint8_t opcode)
+{
+	struct rtsx_profile *p;
+	uint8_t phase = 0xff;
+	int i, d;
+
+	RTSX_LOCK(sc);
+	p = sc->rtsx_profile;
+	if (p != NULL && p->timing == sc->rtsx_host.ios.timing &&
+	    p->clock == sc->rtsx_host.ios.clock)
+		phase = p->rx_phase;
+	RTSX_UNLOCK(sc);
+	if (phase == 0xff)
+		return (0xff);
+
+	for (i = 0; i < RTSX_RX_TUNING_CNT; i++) {
+		for (d = -1; d <= 1; d++) {
+			if (rtsx_tune_phase(sc, opcode,
+					    (phase + RTSX_PHASE_MAX + d) % RTSX_PHASE_MAX)) {
+				RTSX_LOCK(sc);
+				/* The card may have been removed meanwhile. */
+				if (sc->rtsx_profile == p)
+					p->rx_phase = 0xff;
+				RTSX_UNLOCK(sc);
+				return (0xff);
+			}
+		}
+	}
+	RTSX_LOCK(sc);
+	sc->rtsx_profile_hits++;
+	RTSX_UNLOCK(sc);
+
+	return (phase);
+}
+
+/*
+ * Remember the settings of a successful tuning, phase 0xff if it failed.
+ */
+static void
+rtsx_profile_save(struct rtsx_softc *sc, uint8_t phase)
+{
+	struct rtsx_profile *p = sc->rtsx_profile;
+
+	if (p == NULL)
+		return;
+
+	p->timing = sc->rtsx_host.ios.timing;
+	p->clock = sc->rtsx_host.ios.clock;
+	p->rx_phase = phase;
+	p->drive_calibrated = sc->rtsx_drive_calibrated && phase != 0xff;
+	p->drive_sel = sc->rtsx_sd30_drive_sel_1v8;
+}
+
+/*
+ * A tuning command is done: wake up rtsx_tune_phase().
+ */
+static void
+rtsx_tune_req_done(struct mmc_request *req)
+{
+
+	req->flags |= MMC_REQ_DONE;
+	wakeup(req);
+}
+
+/*
+ * Check the tuning block comparison result and terminate the request.
+ */
+static void
+rtsx_tune_phase_done(struct rtsx_softc *sc)
+{
+	uint8_t stat1;
+
+	/* Sync command DMA buffer. */
+	bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_POSTREAD);
+	bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_POSTWRITE);
+
+	/* First byte is CHECK_REG_CMD return value, second one is SD_STAT1. */
+	stat1 = ((uint8_t *)RTSX_CMD_BUF(sc, sc->rtsx_cmd_run))[1];
+	if (stat1 & RTSX_SD_TUNING_COMPARE_ERR)
+		sc->rtsx_curcmd->error = MMC_ERR_FAILED;
+
+	rtsx_req_done(sc);
+}
+
+/*
+ * Send the tuning command with the given sample point and let the
+ * controller compare the tuning block (AUTO_TUNING transfer mode).
+ * Called without the lock, sleeps until the command is done.
+ * from linux: rtsx_pci_sdmmc.c sd_tuning_phase().
+ */
+static int
+rtsx_tune_phase(struct rtsx_softc *sc, uint8_t opcode, uint8_t phase)
+{
+	struct mmc_request req;
+	struct mmc_command cmd;
+	struct mmc_data data;
+	int error;
+
+	if ((error = rtsx_sd_change_phase(sc, phase, true)))
+		return (error);
+
+	memset(&req, 0, sizeof(req));
+	memset(&cmd, 0, sizeof(cmd));
+	memset(&data, 0, sizeof(data));
+	cmd.opcode = opcode;
+	cmd.flags = MMC_RSP_R1 | MMC_CMD_ADTC;
+	cmd.data = &data;
+	cmd.mrq = &req;
+	data.len = (opcode == MMC_SEND_TUNING_BLOCK_HS200 &&
+		    sc->rtsx_host.ios.bus_width == bus_width_8) ? 128 : 64;
+	data.xfer_len = data.len;
+	data.flags = MMC_DATA_READ;
+	data.mrq = &req;
+	req.cmd = &cmd;
+	req.done = rtsx_tune_req_done;
+
+	RTSX_LOCK(sc);
+	sc->rtsx_req = &req;
+	sc->rtsx_intr_status = 0;
+	sc->rtsx_req_owner = curthread;
+	RTSX_UNLOCK(sc);
+	sc->rtsx_curcmd = &cmd;
+
+	rtsx_init_cmd(sc, &cmd);
+
+	/* Queue commands to configure data transfer size. */
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BYTE_CNT_L,
+		      0xff, data.len & 0xff);
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BYTE_CNT_H,
+		      0xff, data.len >> 8);
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BLOCK_CNT_L, 0xff, 1);
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BLOCK_CNT_H, 0xff, 0);
+
+	/* from linux: rtsx_pci_sdmmc.c sd_read_data(). */
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_CFG2,
+		      0xff, RTSX_SD_CALCULATE_CRC7 | RTSX_SD_CHECK_CRC16 |
+		      RTSX_SD_NO_WAIT_BUSY_END | RTSX_SD_CHECK_CRC7 | RTSX_SD_RSP_LEN_6);
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_CARD_DATA_SOURCE,
+		      0x01, RTSX_PINGPONG_BUFFER);
+
+	/* Queue commands to perform the tuning transfer. */
+	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_TRANSFER,
+		      0xff, RTSX_TM_AUTO_TUNING | RTSX_SD_TRANSFER_START);
+	rtsx_push_cmd(sc, RTSX_CHECK_REG_CMD, RTSX_SD_TRANSFER,
+		      RTSX_SD_TRANSFER_END, RTSX_SD_TRANSFER_END);
+	rtsx_push_cmd(sc, RTSX_READ_REG_CMD, RTSX_SD_STAT1, 0, 0);
+
+	sc->rtsx_intr_trans_ok = rtsx_tune_phase_done;
+	rtsx_send_cmd(sc);
+	rtsx_req_release(sc);
 
-		error = rtsx_send_cmd(sc, cmd);
-	}
+	RTSX_LOCK(sc);
+	while (!(req.flags & MMC_REQ_DONE))
+		msleep(&req, &sc->rtsx_mtx, 0, "rtsxtn", 0);
+	RTSX_UNLOCK(sc);
 
-	return (error);
+	return ((cmd.error != MMC_ERR_NONE) ? EIO : 0);
 }
 
 /*
- * Use the ping-pong buffer (cmd buffer) for transfer <= 512 bytes.
+ * Return the phase at the centre of the widest window of passing phases,
+ * which may wrap around, or 0xff if there is none. The width of the
+ * window is returned in width if not NULL.
+ * from linux: rtsx_pci_sdmmc.c sd_search_final_phase().
  */
-static int
-rtsx_read_ppbuf(struct rtsx_softc *sc, struct mmc_command *cmd)
+static uint8_t
+rtsx_search_final_phase(uint32_t phase_map, int *width)
 {
+	int start = 0, len;
+	int start_final = 0, len_final = 0;
+
+	if (width != NULL)
+		*width = 0;
+	if (phase_map == 0)
+		return (0xff);
+
+	while (start < RTSX_PHASE_MAX) {
+		for (len = 0; len < RTSX_PHASE_MAX; len++)
+			if (!(phase_map & (1U << ((start + len) % RTSX_PHASE_MAX))))
+				break;
+		if (len > len_final) {
+			start_final = start;
+			len_final = len;
+		}
+		start += (len > 0) ? len : 1;
+	}
+	if (width != NULL)
+		*width = len_final;
 
-	uint16_t reg = RTSX_PPBUF_BASE2;
-	uint8_t *ptr = cmd->data->data;
-	int remain = cmd->data->len;
-	int i, j;
-	int error;
+	return ((start_final + len_final / 2) % RTSX_PHASE_MAX);
+}
 
-	for (j = 0; j < cmd->data->len / RTSX_HOSTCMD_MAX; j++) {
-		sc->rtsx_cmd_index = 0;
-		for (i = 0; i < RTSX_HOSTCMD_MAX; i++) {
-			rtsx_push_cmd(sc, RTSX_READ_REG_CMD, reg++,
-				      0, 0);
-		}
-		if ((error = rtsx_send_cmd(sc, cmd)))
-		    return (error);
-
-		/* Sync command DMA buffer. */
-		bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_POSTREAD);
-		bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_POSTWRITE);
-
-		memcpy(ptr, sc->rtsx_cmd_dmamem, RTSX_HOSTCMD_MAX);
-		ptr += RTSX_HOSTCMD_MAX;
-		remain -= RTSX_HOSTCMD_MAX;
-	}
-	if (remain > 0) {
-		sc->rtsx_cmd_index = 0;
-		for (i = 0; i < remain; i++) {
-			rtsx_push_cmd(sc, RTSX_READ_REG_CMD, reg++,
-				      0, 0);
+/*
+ * Sweep all the RX phases a few times, phase_map gets the phases
+ * which always passed.
+ * from linux: rtsx_pci_sdmmc.c sd_tuning_rx().
+ */
+static int
+rtsx_tune_rx(struct rtsx_softc *sc, uint8_t opcode, uint32_t *phase_map)
+{
+	uint32_t raw_phase_map[RTSX_RX_TUNING_CNT];
+	int i, phase;
+
+	*phase_map = 0xffffffff;
+	for (i = 0; i < RTSX_RX_TUNING_CNT; i++) {
+		raw_phase_map[i] = 0;
+		for (phase = 0; phase < RTSX_PHASE_MAX; phase++) {
+			if (!ISSET(sc->rtsx_flags, RTSX_F_CARD_PRESENT))
+				return (ENXIO);
+			if (rtsx_tune_phase(sc, opcode, phase) == 0)
+				raw_phase_map[i] |= (1U << phase);
 		}
-		if ((error = rtsx_send_cmd(sc, cmd)))
-			return (error);
+		if (bootverbose)
+			device_printf(sc->rtsx_dev, "Tuning pass %d: RX phase map 0x%08x\n",
+				      i, raw_phase_map[i]);
+		*phase_map &= raw_phase_map[i];
+		if (raw_phase_map[i] == 0)
+			break;
+	}
 
-		/* Sync command DMA buffer. */
-		bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_POSTREAD);
-		bus_dmamap_sync(sc->rtsx_cmd_dma_tag, sc->rtsx_cmd_dmamap, BUS_DMASYNC_POSTWRITE);
+	return (0);
+}
 
-		memcpy(ptr, sc->rtsx_cmd_dmamem, remain);
-	}
+/*
+ * Apply the SD 3.0 drive strength of the current signalling voltage.
+ */
+static int
+rtsx_set_sd30_drive(struct rtsx_softc *sc)
+{
+	int vccq = sc->rtsx_vccq_180 ? 180 : 330;
+
+	if (sc->rtsx_flags & (RTSX_F_5227 | RTSX_F_522A))
+		return (rtsx_rts5227_fill_driving(sc, vccq));
+	if (sc->rtsx_flags & (RTSX_F_525A | RTSX_F_5249))
+		return (rtsx_rts5249_fill_driving(sc, vccq));
+	RTSX_BITOP(sc, RTSX_SD30_CMD_DRIVE_SEL, RTSX_SD30_DRIVE_SEL_MASK,
+		   sc->rtsx_vccq_180 ? sc->rtsx_sd30_drive_sel_1v8 : sc->rtsx_sd30_drive_sel_3v3);
 
 	return (0);
 }
 
 /*
- * Use the ping-pong buffer (cmd buffer) for transfer <= 512 bytes.
+ * Try the driver types A to D at the tuning clock and keep the one with
+ * the widest window of passing RX phases, the vendor setting on a tie.
+ * Tuned modes use 1.8V signalling so only the 1.8V drive is calibrated.
  */
 static int
-rtsx_write_ppbuf(struct rtsx_softc *sc, struct mmc_command *cmd)
+rtsx_calibrate_drive(struct rtsx_softc *sc, uint8_t opcode)
 {
-	uint16_t reg = RTSX_PPBUF_BASE2;
-	uint8_t *ptr = cmd->data->data;
-	int remain = cmd->data->len;
-	int i, j;
+	/* Driver types A, B, C, D as table index or register value. */
+	const uint8_t cfg_types[] = { RTSX_CFG_DRIVER_TYPE_A, RTSX_CFG_DRIVER_TYPE_B,
+				      RTSX_CFG_DRIVER_TYPE_C, RTSX_CFG_DRIVER_TYPE_D };
+	const uint8_t reg_types[] = { RTSX_DRIVER_TYPE_A, RTSX_DRIVER_TYPE_B,
+				      RTSX_DRIVER_TYPE_C, RTSX_DRIVER_TYPE_D };
+	const uint8_t *types;
+	uint32_t phase_map;
+	uint8_t best;
+	int best_width, width;
 	int error;
+	int i;
 
-	for (j = 0; j < cmd->data->len / RTSX_HOSTCMD_MAX; j++) {
-		sc->rtsx_cmd_index = 0;
-		for (i = 0; i < RTSX_HOSTCMD_MAX; i++) {
-			rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, reg++,
-				      0xff, *ptr);
-			ptr++;
-		}
-		if ((error = rtsx_send_cmd(sc, cmd)))
-		    return (error);
+	if (!sc->rtsx_vccq_180)
+		return (0);
+	if (sc->rtsx_flags & (RTSX_F_5227 | RTSX_F_522A | RTSX_F_525A | RTSX_F_5249))
+		types = cfg_types;
+	else
+		types = reg_types;
 
-		remain -= RTSX_HOSTCMD_MAX;
-	}
-	if (remain > 0) {
-		sc->rtsx_cmd_index = 0;
-		for (i = 0; i < remain; i++) {
-			rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, reg++,
-				      0xff, *ptr);
-			ptr++;
+	best = sc->rtsx_sd30_drive_sel_vendor;
+	sc->rtsx_sd30_drive_sel_1v8 = best;
+	if ((error = rtsx_set_sd30_drive(sc)) ||
+	    (error = rtsx_tune_rx(sc, opcode, &phase_map)))
+		return (error);
+	rtsx_search_final_phase(phase_map, &best_width);
+
+	for (i = 0; i < nitems(cfg_types); i++) {
+		if (types[i] == sc->rtsx_sd30_drive_sel_vendor)
+			continue;
+		sc->rtsx_sd30_drive_sel_1v8 = types[i];
+		if ((error = rtsx_set_sd30_drive(sc)) ||
+		    (error = rtsx_tune_rx(sc, opcode, &phase_map)))
+			break;
+		rtsx_search_final_phase(phase_map, &width);
+		if (bootverbose)
+			device_printf(sc->rtsx_dev, "Driver type %c: RX window of %d phases\n",
+				      'A' + i, width);
+		if (width > best_width) {
+			best = types[i];
+			best_width = width;
 		}
-		if ((error = rtsx_send_cmd(sc, cmd)))
-			return (error);
 	}
 
-	return (0);
+	sc->rtsx_sd30_drive_sel_1v8 = best;
+	if (error == 0)
+		error = rtsx_set_sd30_drive(sc);
+	if (error == 0) {
+		sc->rtsx_drive_calibrated = true;
+		device_printf(sc->rtsx_dev, "1.8V drive strength 0x%02x (vendor 0x%02x), RX window of %d phases\n",
+			      best, sc->rtsx_sd30_drive_sel_vendor, best_width);
+	}
+
+	return (error);
 }
 
 /*
- * Use the data buffer for transfer > 512 bytes.
+ * Tune the sample point of SDR50, SDR104 and HS200: sweep all the RX
+ * phases a few times and keep the centre of the widest window of phases
+ * which always passed.
+ * from linux: rtsx_pci_sdmmc.c sd_tuning_rx().
  */
 static int
-rtsx_xfer(struct rtsx_softc *sc, struct mmc_command *cmd)
+rtsx_tune(struct rtsx_softc *sc)
 {
-	uint8_t cfg2;
-	int read = ISSET(cmd->data->flags, MMC_DATA_READ);
-	int dma_dir;
-	int tmode;
+	enum mmc_bus_timing timing = sc->rtsx_host.ios.timing;
+	uint32_t phase_map = 0;
+	uint8_t opcode;
+	uint8_t final_phase;
 	int error = 0;
 
-	if (cmd->data->xfer_len == 0)
-		cmd->data->xfer_len = (cmd->data->len > RTSX_MAX_DATA_BLKLEN) ?
-			RTSX_MAX_DATA_BLKLEN : cmd->data->len;
-
-	if (bootverbose)
-		device_printf(sc->rtsx_dev, "rtsx_xfer() - %s xfer: %ld bytes with block size %ld\n",
-			      read ? "Read" : "Write",
-			      (unsigned long)cmd->data->len, (unsigned long)cmd->data->xfer_len);
+	switch (timing) {
+	case bus_timing_uhs_sdr104:
+	case bus_timing_uhs_sdr50:
+		opcode = MMC_SEND_TUNING_BLOCK;
+		break;
+	case bus_timing_mmc_hs200:
+		opcode = MMC_SEND_TUNING_BLOCK_HS200;
+		break;
+	default:
+		/* No tuning needed. */
+		return (0);
+	}
 
-	if (cmd->data->len > RTSX_DMA_DATA_BUFSIZE) {
-		device_printf(sc->rtsx_dev, "rtsx_xfer() length too large: %ld > %d\n",
-			      (unsigned long)cmd->data->len, RTSX_DMA_DATA_BUFSIZE);
-		cmd->error = MMC_ERR_INVALID;
-		return (MMC_ERR_INVALID);
+	RTSX_LOCK(sc);
+	if (sc->rtsx_req != NULL) {
+		RTSX_UNLOCK(sc);
+		return (EBUSY);
 	}
+	sc->rtsx_tuning = true;
+	RTSX_UNLOCK(sc);
 
-	if (!read) {
-		if ((error = rtsx_send_req_get_resp(sc, cmd)))
-			return (error);
+	/* First tuning of the card, calibrate the drive strength if asked. */
+	if (sc->rtsx_drive_calib && !sc->rtsx_drive_calibrated &&
+	    (error = rtsx_calibrate_drive(sc, opcode)))
+		goto done;
+
+	/* A known card is first tried at its previous sample point. */
+	final_phase = rtsx_profile_phase(sc, opcode);
+	if (final_phase == 0xff) {
+		if ((error = rtsx_tune_rx(sc, opcode, &phase_map)))
+			goto done;
+		final_phase = rtsx_search_final_phase(phase_map, NULL);
+	}
+	if (final_phase == 0xff) {
+		device_printf(sc->rtsx_dev, "Tuning failed: no working RX phase\n");
+		/* Do not reuse a drive strength which does not work anymore. */
+		if (sc->rtsx_drive_calibrated) {
+			sc->rtsx_drive_calibrated = false;
+			sc->rtsx_sd30_drive_sel_1v8 = sc->rtsx_sd30_drive_sel_vendor;
+			(void)rtsx_set_sd30_drive(sc);
+		}
+		RTSX_LOCK(sc);
+		rtsx_profile_save(sc, 0xff);
+		RTSX_UNLOCK(sc);
+		error = EIO;
+		goto done;
 	}
+	if ((error = rtsx_sd_change_phase(sc, final_phase, true)))
+		goto done;
+	RTSX_LOCK(sc);
+	sc->rtsx_tuned_clock = sc->rtsx_host.ios.clock;
+	rtsx_profile_save(sc, final_phase);
+
+	/* Start a new re-tuning period. */
+	sc->rtsx_retune_req = retune_req_none;
+	sc->rtsx_crc_errors = 0;
+	if (sc->rtsx_retune_period > 0)
+		callout_reset(&sc->rtsx_retune_callout, sc->rtsx_retune_period * hz,
+			      rtsx_retune_timeout, sc);
+	RTSX_UNLOCK(sc);
 
-	/* Configure DMA transfer mode parameters. */
-	if (cmd->opcode == MMC_READ_MULTIPLE_BLOCK)
-		cfg2 = RTSX_SD_CHECK_CRC16 | RTSX_SD_NO_WAIT_BUSY_END | RTSX_SD_RSP_LEN_6;
-	else
-		cfg2 = RTSX_SD_CHECK_CRC16 | RTSX_SD_NO_WAIT_BUSY_END | RTSX_SD_RSP_LEN_0;
-	if (read) {
-		dma_dir = RTSX_DMA_DIR_FROM_CARD;
-		/*
-		 * Use transfer mode AUTO_READ1, which assume we not
-		 * already send the read command and don't need to send
-		 * CMD 12 manually after read.
-		 */
-     		tmode = RTSX_TM_AUTO_READ1;
-		cfg2 |= RTSX_SD_CALCULATE_CRC7 | RTSX_SD_CHECK_CRC7;
+	if (bootverbose)
+		device_printf(sc->rtsx_dev, "Tuned RX phase %u (map 0x%08x) at %u Hz\n",
+			      final_phase, phase_map, sc->rtsx_tuned_clock);
 
-		rtsx_init_cmd(sc, cmd);
-	} else {
-		dma_dir = RTSX_DMA_DIR_TO_CARD;
-		/*
-		 * Use transfer mode AUTO_WRITE3, wich assumes we've already
-		 * sent the write command and gotten the response, and will
-		 * send CMD 12 manually after writing.
-		 */
-		tmode = RTSX_TM_AUTO_WRITE3;
-		cfg2 |= RTSX_SD_NO_CALCULATE_CRC7 | RTSX_SD_NO_CHECK_CRC7;
+ done:
+	sc->rtsx_tuning = false;
 
-		sc->rtsx_cmd_index = 0;
-	}
+	return (error);
+}
 
-	/* Queue commands to configure data transfer size. */
-	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BYTE_CNT_L,
-		      0xff, (cmd->data->xfer_len & 0xff));
-	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BYTE_CNT_H,
-		      0xff, (cmd->data->xfer_len >> 8));
-	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BLOCK_CNT_L,
-		      0xff, ((cmd->data->len / cmd->data->xfer_len) & 0xff));
-	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_BLOCK_CNT_H,
-		      0xff, ((cmd->data->len / cmd->data->xfer_len) >> 8));
+/*
+ * Called by the callout at the end of the re-tuning period.
+ */
+static void
+rtsx_retune_timeout(void *arg)
+{
+	struct rtsx_softc *sc = arg;
 
-	/* Configure DMA controller. */
-	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_IRQSTAT0,
-		     RTSX_DMA_DONE_INT, RTSX_DMA_DONE_INT);
-	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_DMATC3,
-		     0xff, cmd->data->len >> 24);
-	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_DMATC2,
-		     0xff, cmd->data->len >> 16);
-	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_DMATC1,
-		     0xff, cmd->data->len >> 8);
-	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_DMATC0,
-		     0xff, cmd->data->len);
-	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_DMACTL,
-		     RTSX_DMA_EN | RTSX_DMA_DIR | RTSX_DMA_PACK_SIZE_MASK,
-		     RTSX_DMA_EN | dma_dir | RTSX_DMA_512);
+	rtsx_request_retune(sc, "re-tuning period");
+}
 
-	/* Use the DMA ring buffer for commands which transfer data. */
-	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_CARD_DATA_SOURCE,
-		      0x01, RTSX_RING_BUFFER);
+/*
+ * Ask the mmc bus to re-tune through MMCBR_IVAR_RETUNE_REQ,
+ * if the current mode has been tuned.
+ */
+static void
+rtsx_request_retune(struct rtsx_softc *sc, const char *reason)
+{
 
-	/* Queue command to set response type. */
-	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_CFG2,
-		     0xff, cfg2); 
+	if (sc->rtsx_tuned_clock == 0 || sc->rtsx_retune_req != retune_req_none)
+		return;
 
-	/* Queue commands to perform SD transfer. */
-	rtsx_push_cmd(sc, RTSX_WRITE_REG_CMD, RTSX_SD_TRANSFER,
-		      0xff, tmode | RTSX_SD_TRANSFER_START);
-	rtsx_push_cmd(sc, RTSX_CHECK_REG_CMD, RTSX_SD_TRANSFER,
-		      RTSX_SD_TRANSFER_END, RTSX_SD_TRANSFER_END);
+	if (bootverbose)
+		device_printf(sc->rtsx_dev, "Re-tuning requested: %s\n", reason);
 
-	/* Run the command queue and don't wait for completion. */
-	rtsx_send_cmd_nowait(sc, cmd);
+	sc->rtsx_retunes++;
+	sc->rtsx_retune_req = retune_req_normal;
+}
 
-	sc->rtsx_intr_status = 0;
+/*
+ * Speed fallback ladder: too many data errors within the error window
+ * lower the SD clock limit one level, SDR104 -> SDR50 -> HS -> DS speed.
+ * Levels which don't lower the current SD clock are skipped.
+ * The card stays in its timing mode, the mmc bus owns the CMD 6 switch.
+ */
+static void
+rtsx_speed_error(struct rtsx_softc *sc)
+{
+	uint32_t clock;
+	int level;
+
+	sc->rtsx_speed_ticks = ticks;
+	if (sc->rtsx_speed_errors == 0 ||
+	    ticks - sc->rtsx_speed_window_start > sc->rtsx_speed_window * hz) {
+		sc->rtsx_speed_window_start = ticks;
+		sc->rtsx_speed_errors = 0;
+	}
+	if (sc->rtsx_speed_threshold <= 0 ||
+	    ++sc->rtsx_speed_errors < sc->rtsx_speed_threshold)
+		return;
 
-	if (!read)
-		memcpy(sc->rtsx_data_dmamem, cmd->data->data, cmd->data->len);
+	clock = rtsx_speed_clock[sc->rtsx_speed_level];
+	if (sc->rtsx_clock_req != 0 && sc->rtsx_clock_req < clock)
+		clock = sc->rtsx_clock_req;
+	for (level = sc->rtsx_speed_level + 1; level < nitems(rtsx_speed_clock); level++)
+		if (rtsx_speed_clock[level] < clock)
+			break;
+	if (level == nitems(rtsx_speed_clock))
+		return;
 
-	/* Sync data DMA buffer. */
-	bus_dmamap_sync(sc->rtsx_data_dma_tag, sc->rtsx_data_dmamap, BUS_DMASYNC_PREREAD);
-	bus_dmamap_sync(sc->rtsx_data_dma_tag, sc->rtsx_data_dmamap, BUS_DMASYNC_PREWRITE);
+	sc->rtsx_speed_errors = 0;
+	sc->rtsx_speed_level = level;
+	sc->rtsx_speed_downs++;
+	device_printf(sc->rtsx_dev, "Too many data errors, SD clock limited to %u Hz\n",
+		      rtsx_speed_clock[sc->rtsx_speed_level]);
+}
 
-	/* Tell the chip where the data buffer is and run the transfer. */
-	WRITE4(sc, RTSX_HDBAR, sc->rtsx_data_buffer);
-	WRITE4(sc, RTSX_HDBCTLR, RTSX_TRIG_DMA | (read ? RTSX_DMA_READ : 0) |
-	       (cmd->data->len & 0x00ffffff));
+/*
+ * After a clean period, probe the next speed level up.
+ * A level at or above the requested SD clock is no limit, back to full speed.
+ */
+static void
+rtsx_speed_ok(struct rtsx_softc *sc)
+{
 
-	if ((error = rtsx_wait_intr(sc, RTSX_TRANS_OK_INT, hz * sc->rtsx_timeout))) {
-		cmd->error = error;
-		return (error);
-	}
+	if (sc->rtsx_speed_level == 0 || sc->rtsx_speed_clean <= 0 ||
+	    ticks - sc->rtsx_speed_ticks < sc->rtsx_speed_clean * hz)
+		return;
+
+	sc->rtsx_speed_ticks = ticks;
+	sc->rtsx_speed_level--;
+	if (sc->rtsx_clock_req != 0 &&
+	    rtsx_speed_clock[sc->rtsx_speed_level] >= sc->rtsx_clock_req)
+		sc->rtsx_speed_level = 0;
+	sc->rtsx_speed_ups++;
+	if (bootverbose)
+		device_printf(sc->rtsx_dev, "SD clock limit raised to %u Hz\n",
+			      rtsx_speed_clock[sc->rtsx_speed_level]);
+}
+
+/*
+ * Program the SD clock for a new speed level, before the next request.
+ */
+static int
+rtsx_speed_apply(struct rtsx_softc *sc)
+{
+	int error;
 
-	/* Sync data DMA buffer. */
-	bus_dmamap_sync(sc->rtsx_data_dma_tag, sc->rtsx_data_dmamap, BUS_DMASYNC_POSTREAD);
-	bus_dmamap_sync(sc->rtsx_data_dma_tag, sc->rtsx_data_dmamap, BUS_DMASYNC_POSTWRITE);
+	/* The sample point is searched again at the new clock. */
+	RTSX_LOCK(sc);
+	rtsx_request_retune(sc, "speed level change");
+	RTSX_UNLOCK(sc);
 
-	if (read)
-		memcpy(cmd->data->data, sc->rtsx_data_dmamem, cmd->data->len);
+	rtsx_batch_start(sc);
+	error = rtsx_set_sd_clock(sc, sc->rtsx_clock_req);
+	/* The SD 2.0 clock settings have replaced those of the timing. */
+	if (error == 0)
+		error = rtsx_set_sd_timing(sc, sc->rtsx_host.ios.timing);
+	if (error == 0)
+		error = rtsx_batch_end(sc);
 	else
-		/* Send CMD12 after AUTO_WRITE3 (see mmcsd_rw() in mmcsd.c). */
-		error = rtsx_send_req_get_resp(sc, sc->rtsx_req->stop);
+		rtsx_batch_end(sc);
 
 	return (error);
 }
@@ -2221,6 +4454,8 @@ rtsx_read_ivar(device_t bus, device_t child, int which, uintptr_t *result)
 		*result = MAXPHYS / MMC_SECTOR_SIZE;
 		break;
 	case MMCBR_IVAR_RETUNE_REQ:		/* ivar 10 */
+		*result = sc->rtsx_retune_req;
+		break;
 	case MMCBR_IVAR_MAX_BUSY_TIMEOUT:	/* ivar 16 */
 	default:
 		return (EINVAL);
@@ -2260,6 +4495,8 @@ rtsx_write_ivar(device_t bus, device_t child, int which, uintptr_t value)
 		break;
 	case MMCBR_IVAR_MODE:			/* ivar  7 - 0 = mode_mmc, 1 = mode_sd */ 
 		sc->rtsx_host.mode = value;
+		/* CMD 23 is mandatory for MMC cards, SD cards tell it in their SCR. */
+		sc->rtsx_card_cmd23 = (value == mode_mmc);
 		break;
 	case MMCBR_IVAR_OCR:			/* ivar  8 - operation conditions register */
 		sc->rtsx_host.ocr = value;
@@ -2277,6 +4514,7 @@ rtsx_write_ivar(device_t bus, device_t child, int which, uintptr_t value)
 	case MMCBR_IVAR_TIMING:			/* ivar 14 - 0 = normal, 1 = timing_hs, ... */
 		sc->rtsx_host.ios.timing = value;
 		sc->rtsx_ios_timing = -1;	/* To be updated on next rtsx_mmcbr_update_ios(). */
+		sc->rtsx_ios_clock = -1;	/* SD 3.0 modes change the clock settings. */
 		break;
 	/* These are read-only. */
 	case MMCBR_IVAR_F_MIN:			/* ivar  4 */
@@ -2306,42 +4544,21 @@ rtsx_mmcbr_update_ios(device_t bus, device_t child)
 	if (bootverbose)
 		device_printf(bus, "rtsx_mmcbr_update_ios()\n");
 
+	rtsx_batch_start(sc);
+
 	/* if MMCBR_IVAR_BUS_WIDTH updated. */
 	if (sc->rtsx_ios_bus_width < 0) {
-		uint32_t bus_width;
-
 		sc->rtsx_ios_bus_width = ios->bus_width;
-		switch (ios->bus_width) {
-		case bus_width_1:
-			bus_width = RTSX_BUS_WIDTH_1;
-			break;
-		case bus_width_4:
-			bus_width = RTSX_BUS_WIDTH_4;
-			break;
-		case bus_width_8:
-			bus_width = RTSX_BUS_WIDTH_8;
-			break;
-		default:
-			return (MMC_ERR_INVALID);
-		}
-		if ((error = rtsx_write(sc, RTSX_SD_CFG1, RTSX_BUS_WIDTH_MASK, bus_width)))
-			return (error);
-
-		if (bootverbose) {
-			char *busw[] = {
-					"1 bit",
-					"4 bits",
-					"8 bits"
-			};
-				device_printf(sc->rtsx_dev, "Setting bus width to %s\n", busw[bus_width]);
-		}
+		if ((error = rtsx_set_bus_width(sc, ios->bus_width)))
+			goto done;
 	}
 
 	/* if MMCBR_IVAR_CLOCK updated. */
 	if (sc->rtsx_ios_clock < 0) {
 		sc->rtsx_ios_clock = ios->clock;
+		sc->rtsx_clock_req = ios->clock;
 		if ((error = rtsx_set_sd_clock(sc, ios->clock)))
-			return (error);
+			goto done;
 	}
 
 	/* if MMCBR_IVAR_POWER_MODE updated. */
@@ -2350,15 +4567,15 @@ rtsx_mmcbr_update_ios(device_t bus, device_t child)
 		switch (ios->power_mode) {
 		case power_off:
 			if ((error = rtsx_bus_power_off(sc)))
-				return (error);
+				goto done;
 			break;
 		case power_up:
 			if ((error = rtsx_bus_power_on(sc)))
-				return (error);
+				goto done;
 			break;
 		case power_on:
 			if ((error = rtsx_bus_power_on(sc)))
-				return (error);
+				goto done;
 			break;
 		}
 	}
@@ -2367,10 +4584,23 @@ rtsx_mmcbr_update_ios(device_t bus, device_t child)
 	if (sc->rtsx_ios_timing < 0) {
 		sc->rtsx_ios_timing = ios->timing;
 		if ((error = rtsx_set_sd_timing(sc, ios->timing)))
+			goto done;
+	}
+
+	if ((error = rtsx_batch_end(sc)))
+		return (error);
+
+	/* Tune again if the clock of a tuned mode has changed. */
+	if (sc->rtsx_tuned_clock != 0 && sc->rtsx_tuned_clock != ios->clock) {
+		if ((error = rtsx_tune(sc)))
 			return (error);
 	}
 
 	return (0);
+
+ done:
+	rtsx_batch_end(sc);
+	return (error);
 }
 
 /*
@@ -2381,6 +4611,7 @@ rtsx_mmcbr_switch_vccq(device_t bus, device_t child __unused)
 {
 	struct rtsx_softc *sc;
 	int vccq = 0;
+	bool cmd11;
 	int error;
 
 	sc = device_get_softc(bus);
@@ -2396,56 +4627,33 @@ rtsx_mmcbr_switch_vccq(device_t bus, device_t child __unused)
 		vccq = 330;
 		break;
 	};
-	/* It seems it is always vccq_330. */
-	if (vccq == 330) {
-		if (sc->rtsx_flags & RTSX_F_5227) {
-			/*!!!*/
-			if ((error = rtsx_write_phy(sc, 0x08, 0x4FE4)))
-				return (error);
-			if ((error = rtsx_rts5227_fill_driving(sc)))
-				return (error);
-		} else if (sc->rtsx_flags & RTSX_F_5229) {
-			RTSX_BITOP(sc, RTSX_SD30_CMD_DRIVE_SEL, RTSX_SD30_DRIVE_SEL_MASK, sc->rtsx_sd30_drive_sel_3v3);
-			if ((error = rtsx_write_phy(sc, 0x08, 0x4FE4)))
-				return (error);
-		} else if (sc->rtsx_flags & RTSX_F_522A) {
-			if ((error = rtsx_write_phy(sc, 0x08, 0x57E4)))
-				return (error);
-			if ((error = rtsx_rts5227_fill_driving(sc)))
-				return (error);
-		} else if (sc->rtsx_flags & RTSX_F_525A) {
-			RTSX_BITOP(sc, RTSX_LDO_CONFIG2, RTSX_LDO_D3318_MASK, RTSX_LDO_D3318_33V);
-			RTSX_BITOP(sc, RTSX_SD_PAD_CTL, RTSX_SD_IO_USING_1V8, 0);
-			if ((error = rtsx_rts5249_fill_driving(sc)))
-				return (error);
-		} else if (sc->rtsx_flags & RTSX_F_5249) {
-			uint16_t val;
-
-			if ((error = rtsx_read_phy(sc, RTSX_PHY_TUNE, &val)))
-				return (error);
-			if ((error = rtsx_write_phy(sc, RTSX_PHY_TUNE,
-						    (val & RTSX_PHY_TUNE_VOLTAGE_MASK) | RTSX_PHY_TUNE_VOLTAGE_3V3)))
-				return (error);
-			if ((error = rtsx_rts5249_fill_driving(sc)))
-				return (error);
-		} else if (sc->rtsx_flags & RTSX_F_8402) {
-			RTSX_BITOP(sc, RTSX_SD30_CMD_DRIVE_SEL, RTSX_SD30_DRIVE_SEL_MASK, sc->rtsx_sd30_drive_sel_3v3);
-			RTSX_BITOP(sc, RTSX_LDO_CTL,
-				   (RTSX_BPP_ASIC_MASK << RTSX_BPP_SHIFT_8402) | RTSX_BPP_PAD_MASK,
-				   (RTSX_BPP_ASIC_3V3 << RTSX_BPP_SHIFT_8402) | RTSX_BPP_PAD_3V3);
-		} else if (sc->rtsx_flags & (RTSX_F_8411 | RTSX_F_8411B)) {
-			RTSX_BITOP(sc, RTSX_SD30_CMD_DRIVE_SEL, RTSX_SD30_DRIVE_SEL_MASK, sc->rtsx_sd30_drive_sel_3v3);
-			RTSX_BITOP(sc, RTSX_LDO_CTL,
-				   (RTSX_BPP_ASIC_MASK << RTSX_BPP_SHIFT_8411) | RTSX_BPP_PAD_MASK,
-				   (RTSX_BPP_ASIC_3V3 << RTSX_BPP_SHIFT_8411) | RTSX_BPP_PAD_3V3);
-		}
-		DELAY(300);
-	}
 
 	if (bootverbose)
 		device_printf(sc->rtsx_dev, "rtsx_mmcbr_switch_vccq(%d)\n", vccq);
 
-	return (0);
+	/* 1.2V signalling is not supported. */
+	if (vccq == 120)
+		return (EINVAL);
+
+	/* The bus lines are only checked for an SD card answering CMD 11. */
+	RTSX_LOCK(sc);
+	cmd11 = sc->rtsx_cmd11;
+	sc->rtsx_cmd11 = false;
+	RTSX_UNLOCK(sc);
+	if (vccq == 180 && cmd11 && (error = rtsx_wait_voltage_stable_1(sc)))
+		goto done;
+	if ((error = rtsx_switch_output_voltage(sc, vccq)))
+		goto done;
+	if (vccq == 180 && cmd11)
+		error = rtsx_wait_voltage_stable_2(sc);
+	else
+		DELAY(300);
+ done:
+	if (error)
+		device_printf(sc->rtsx_dev, "Switch to %s signalling failed\n",
+			      (vccq == 180) ? "1.8V" : "3.3V");
+
+	return (error);
 }
 
 static int
@@ -2459,7 +4667,11 @@ rtsx_mmcbr_tune(device_t bus, device_t child __unused, bool hs400)
 		device_printf(sc->rtsx_dev, "rtsx_mmcbr_tune() - hs400 = %s\n",
 			      (hs400) ? "true" : "false");
 
-	return (0);
+	/* HS400 is not supported. */
+	if (hs400)
+		return (EINVAL);
+
+	return (rtsx_tune(sc));
 }
 
 static int
@@ -2472,7 +4684,7 @@ rtsx_mmcbr_retune(device_t bus, device_t child __unused, bool reset __unused)
 	if (bootverbose)
 		device_printf(sc->rtsx_dev, "rtsx_mmcbr_retune()\n");
 
-	return (0);
+	return (rtsx_tune(sc));
 }
 
 static int
@@ -2480,10 +4692,12 @@ rtsx_mmcbr_request(device_t bus, device_t child __unused, struct mmc_request *re
 {
 	struct rtsx_softc *sc;
 	struct mmc_command *cmd;
+	bool present, cached;
 	int error = 0;
 
 	sc = device_get_softc(bus);
 
+	/* Claim the request, the rest runs without the lock. */
 	RTSX_LOCK(sc);
 	if (sc->rtsx_req != NULL) {
 		RTSX_UNLOCK(sc);
@@ -2491,8 +4705,12 @@ rtsx_mmcbr_request(device_t bus, device_t child __unused, struct mmc_request *re
         }
 	sc->rtsx_req = req;
 	sc->rtsx_intr_status = 0;
+	sc->rtsx_req_owner = curthread;
+	present = ISSET(sc->rtsx_flags, RTSX_F_CARD_PRESENT);
+	RTSX_UNLOCK(sc);
 	cmd = req->cmd;
 	cmd->error = MMC_ERR_NONE;
+	sc->rtsx_curcmd = cmd;
 
 	if (bootverbose)
 		device_printf(sc->rtsx_dev, "rtsx_mmcbr_request(CMD%u arg %#x flags %#x dlen %u dflags %#x)\n",
@@ -2501,12 +4719,17 @@ rtsx_mmcbr_request(device_t bus, device_t child __unused, struct mmc_request *re
 			      cmd->data != NULL ? cmd->data->flags : 0);
 
 	/* Check if card present. */
-	if (!ISSET(sc->rtsx_flags, RTSX_F_CARD_PRESENT)) {
+	if (!present) {
 		cmd->error = MMC_ERR_INVALID;
 		error = MMC_ERR_INVALID;
 		goto done;
 	}
 
+	/* Follow the speed fallback ladder. */
+	if (sc->rtsx_speed_applied != sc->rtsx_speed_level && sc->rtsx_clock_req != 0 &&
+	    rtsx_speed_apply(sc) != 0)
+		device_printf(sc->rtsx_dev, "Changing the SD clock failed\n");
+
 	/* Refuse SDIO probe if the chip doesn't support SDIO. */
 	if (cmd->opcode == IO_SEND_OP_COND &&
 	    !ISSET(sc->rtsx_flags, RTSX_F_SDIO_SUPPORT)) {
@@ -2515,33 +4738,41 @@ rtsx_mmcbr_request(device_t bus, device_t child __unused, struct mmc_request *re
 		goto done;
 	}
 
+	/*
+	 * Serve single block reads from the sector cache,
+	 * drop it on anything which may change the card content
+	 * or what a block address refers to (eMMC partition switch,
+	 * card selection).
+	 */
+	RTSX_LOCK(sc);
+	cached = cmd->data != NULL && rtsx_cache_lookup(sc, cmd);
+	if (!cached &&
+	    ((cmd->data != NULL && ISSET(cmd->data->flags, MMC_DATA_WRITE)) ||
+	     cmd->opcode == MMC_ERASE || cmd->opcode == MMC_GO_IDLE_STATE ||
+	     cmd->opcode == MMC_SWITCH_FUNC || cmd->opcode == MMC_SELECT_CARD))
+		rtsx_cache_invalidate(sc);
+	RTSX_UNLOCK(sc);
+	if (cached)
+		goto done;
+
 	if (cmd->data == NULL) {
 		/*!!!*/
 		DELAY(200);
-		error = rtsx_send_req_get_resp(sc, cmd);
-	} else if (cmd->data->len <= 512) {
-		if ((error = rtsx_xfer_short(sc, cmd))) {
-			uint8_t stat1;
-			if (rtsx_read(sc, RTSX_SD_STAT1, &stat1) == 0 &&
-			    (stat1 & RTSX_SD_CRC_ERR)) {
-				device_printf(sc->rtsx_dev, "CRC error\n");
-				cmd->error = MMC_ERR_BADCRC;
-			}
-		}
+		if ((error = rtsx_send_req(sc, cmd)) == 0)
+			sc->rtsx_intr_trans_ok = rtsx_send_req_done;
+	} else if (cmd->data->len <= 512 && !rtsx_is_block_xfer(cmd)) {
+		error = rtsx_xfer_short(sc, cmd);
 	} else {
-		if ((error = rtsx_xfer(sc, cmd))) {
-			uint8_t stat1;
-			if (rtsx_read(sc, RTSX_SD_STAT1, &stat1) == 0 &&
-			    (stat1 & RTSX_SD_CRC_ERR)) {
-				device_printf(sc->rtsx_dev, "CRC error\n");
-				cmd->error = MMC_ERR_BADCRC;
-			}
-		}
+		error = rtsx_xfer(sc, cmd);
+	}
+	/* The request is completed by rtsx_intr(). */
+	if (error == 0) {
+		rtsx_req_release(sc);
+		return (0);
 	}
 
  done:
 	rtsx_req_done(sc);
-	RTSX_UNLOCK(sc);
 	return (error);
 }
 
@@ -2641,6 +4872,7 @@ rtsx_attach(device_t dev)
 	struct sysctl_oid_list	*tree;
 	int			msi_count = 1;
 	uint32_t		sdio_cfg;
+	int			mmc_hs200 = 0;
 	int			error;
 
 	if (bootverbose)
@@ -2649,14 +4881,127 @@ rtsx_attach(device_t dev)
 
 	sc->rtsx_dev = dev;
 	RTSX_LOCK_INIT(sc);
+	callout_init_mtx(&sc->rtsx_timeout_callout, &sc->rtsx_mtx, CALLOUT_RETURNUNLOCKED);
+	callout_init_mtx(&sc->rtsx_retune_callout, &sc->rtsx_mtx, 0);
 
-	/* timeout parameter for rtsx_wait_intr(). */
+	/* timeout parameter for rtsx_req_timeout(). */
 	sc->rtsx_timeout = 2;
 	ctx = device_get_sysctl_ctx(dev);
 	tree = SYSCTL_CHILDREN(device_get_sysctl_tree(dev));
 	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "req_timeout", CTLFLAG_RW,
 		       &sc->rtsx_timeout, 0, "Request timeout in seconds");
 
+	/* Size of the command buffers. */
+	sc->rtsx_hostcmd_max = RTSX_HOSTCMD_DEFAULT;
+	TUNABLE_INT_FETCH("hw.rtsx.hostcmd_max", &sc->rtsx_hostcmd_max);
+	if (sc->rtsx_hostcmd_max < RTSX_HOSTCMD_MIN)
+		sc->rtsx_hostcmd_max = RTSX_HOSTCMD_MIN;
+	if (sc->rtsx_hostcmd_max > RTSX_HOSTCMD_LIMIT)
+		sc->rtsx_hostcmd_max = RTSX_HOSTCMD_LIMIT;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "hostcmd_max", CTLFLAG_RD,
+		       &sc->rtsx_hostcmd_max, 0, "Size of a command buffer in commands");
+
+	/*
+	 * Like linux (EXTRA_CAPS_MMC_HS200), none of the supported chips is
+	 * known to run eMMC HS200 and DDR52, they may be tried with a tunable.
+	 */
+	TUNABLE_INT_FETCH("hw.rtsx.mmc_hs200", &mmc_hs200);
+	if (mmc_hs200)
+		sc->rtsx_flags |= RTSX_F_MMC_HS200;
+
+	/* Batch register writes. */
+	sc->rtsx_batch_enable = 1;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "batch", CTLFLAG_RW,
+		       &sc->rtsx_batch_enable, 0, "Batch register writes in the command buffer");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "batches", CTLFLAG_RD,
+		       &sc->rtsx_batches, 0, "Register write batches run");
+
+	/* Register shadow. */
+	sc->rtsx_shadow_enable = 1;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "shadow", CTLFLAG_RW,
+		       &sc->rtsx_shadow_enable, 0, "Skip register accesses known from the shadow");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "shadow_read_hits", CTLFLAG_RD,
+		       &sc->rtsx_shadow_read_hits, 0, "Register reads from the shadow");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "shadow_write_hits", CTLFLAG_RD,
+		       &sc->rtsx_shadow_write_hits, 0, "Register writes skipped");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "shadow_phy_hits", CTLFLAG_RD,
+		       &sc->rtsx_shadow_phy_hits, 0, "PHY register accesses from the shadow");
+
+	/* Use ADMA for data transfer. */
+	sc->rtsx_adma = 1;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "adma", CTLFLAG_RW,
+		       &sc->rtsx_adma, 0, "Use ADMA for data transfer");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "xfer_direct", CTLFLAG_RD,
+		       &sc->rtsx_xfer_direct, 0, "Transfers done from request buffer");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "xfer_adma", CTLFLAG_RD,
+		       &sc->rtsx_xfer_adma, 0, "Transfers done with ADMA");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "xfer_bounce", CTLFLAG_RD,
+		       &sc->rtsx_xfer_bounce, 0, "Transfers done via bounce buffer");
+
+	/* Use CMD 23 for multiple block transfers. */
+	sc->rtsx_cmd23 = 1;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "cmd23", CTLFLAG_RW,
+		       &sc->rtsx_cmd23, 0, "Use CMD 23 when the card supports it");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "xfer_cmd23", CTLFLAG_RD,
+		       &sc->rtsx_xfer_cmd23, 0, "Transfers with a predefined block count");
+
+	/* Re-tuning triggers. */
+	sc->rtsx_retune_period = RTSX_RETUNE_PERIOD;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "retune_period", CTLFLAG_RW,
+		       &sc->rtsx_retune_period, 0, "Re-tuning period in seconds, 0 to disable");
+	sc->rtsx_retune_crc_errors = RTSX_RETUNE_CRC_ERRORS;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "retune_crc_errors", CTLFLAG_RW,
+		       &sc->rtsx_retune_crc_errors, 0, "CRC errors requesting re-tuning, 0 to disable");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "retunes", CTLFLAG_RD,
+		       &sc->rtsx_retunes, 0, "Re-tunings requested");
+
+	/* Settings of known cards. */
+	sc->rtsx_profile_enable = 1;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "profile", CTLFLAG_RW,
+		       &sc->rtsx_profile_enable, 0, "Reuse the settings of known cards");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "profile_hits", CTLFLAG_RD,
+		       &sc->rtsx_profile_hits, 0, "Tunings skipped for known cards");
+
+	/* Drive strength calibration. */
+	sc->rtsx_drive_calib = 0;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "drive_calib", CTLFLAG_RW,
+		       &sc->rtsx_drive_calib, 0, "Calibrate the 1.8V drive strength of new cards");
+
+	/* Speed fallback ladder. */
+	sc->rtsx_speed_threshold = RTSX_SPEED_ERRORS;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "speed_errors", CTLFLAG_RW,
+		       &sc->rtsx_speed_threshold, 0, "Data errors lowering the speed, 0 to disable");
+	sc->rtsx_speed_window = RTSX_SPEED_WINDOW;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "speed_window", CTLFLAG_RW,
+		       &sc->rtsx_speed_window, 0, "Data error window in seconds");
+	sc->rtsx_speed_clean = RTSX_SPEED_CLEAN;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "speed_clean", CTLFLAG_RW,
+		       &sc->rtsx_speed_clean, 0, "Seconds without error raising the speed, 0 to disable");
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "speed_level", CTLFLAG_RD,
+		       &sc->rtsx_speed_level, 0, "Speed fallback level, 0 = full speed");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "speed_downs", CTLFLAG_RD,
+		       &sc->rtsx_speed_downs, 0, "Speed level lowered");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "speed_ups", CTLFLAG_RD,
+		       &sc->rtsx_speed_ups, 0, "Speed level raised");
+
+	/* Sector cache for single block reads. */
+	sc->rtsx_cache_enable = 0;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "cache", CTLFLAG_RW,
+		       &sc->rtsx_cache_enable, 0, "Cache single block reads");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "cache_hits", CTLFLAG_RD,
+		       &sc->rtsx_cache_hits, 0, "Sector cache hits");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "cache_misses", CTLFLAG_RD,
+		       &sc->rtsx_cache_misses, 0, "Sector cache misses");
+
+	/* Resume from the register script. */
+	sc->rtsx_resume_replay = 1;
+	SYSCTL_ADD_INT(ctx, tree, OID_AUTO, "resume_replay", CTLFLAG_RW,
+		       &sc->rtsx_resume_replay, 0, "Restore the registers from a script on resume");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "resume_replays", CTLFLAG_RD,
+		       &sc->rtsx_resume_replays, 0, "Resumes done with the register script");
+	SYSCTL_ADD_U64(ctx, tree, OID_AUTO, "resume_inits", CTLFLAG_RD,
+		       &sc->rtsx_resume_inits, 0, "Resumes done with a full initialization");
+
 	/* Allocate IRQ. */
 	sc->rtsx_irq_res_id = 0;
 	if (pci_alloc_msi(dev, &msi_count) == 0)
@@ -2689,7 +5034,7 @@ rtsx_attach(device_t dev)
 
 	/* Activate the interrupt. */
 	error = bus_setup_intr(dev, sc->rtsx_irq_res, INTR_TYPE_MISC | INTR_MPSAFE,
-			       NULL, rtsx_intr, sc, &sc->rtsx_irq_cookie);
+			       rtsx_intr_filter, rtsx_intr, sc, &sc->rtsx_irq_cookie);
 	if (error) {
 		device_printf(dev, "Can't set up irq [0x%x]!\n", error);
 		goto destroy_rtsx_res;
@@ -2702,7 +5047,15 @@ rtsx_attach(device_t dev)
 			sc->rtsx_flags |= RTSX_F_SDIO_SUPPORT;
 	}
 
-	/* Allocate two DMA buffers: a command buffer and a data buffer. */
+	/* Allocate sector cache, card profiles and register script. */
+	sc->rtsx_cache = malloc(RTSX_CACHE_NENT * sizeof(struct rtsx_cache_entry),
+				M_DEVBUF, M_WAITOK | M_ZERO);
+	sc->rtsx_profiles = malloc(RTSX_PROFILE_NENT * sizeof(struct rtsx_profile),
+				   M_DEVBUF, M_WAITOK | M_ZERO);
+	sc->rtsx_script = malloc(RTSX_SCRIPT_NENT * sizeof(struct rtsx_script),
+				 M_DEVBUF, M_WAITOK | M_ZERO);
+
+	/* Allocate DMA buffers: command, data and ADMA descriptor table. */
 	error = rtsx_dma_alloc(sc);
 	if (error) {
 		goto destroy_rtsx_irq;
@@ -2715,7 +5068,7 @@ rtsx_attach(device_t dev)
 			  rtsx_card_task, sc);
 
 	/* Initialize device. */
-	if (rtsx_init(sc)) {
+	if (rtsx_init_record(sc)) {
 		device_printf(dev, "Error during rtsx_init()\n");
 		goto destroy_rtsx_irq;
 	}
@@ -2737,6 +5090,9 @@ rtsx_attach(device_t dev)
 	return (0);
 
  destroy_rtsx_irq:
+	free(sc->rtsx_cache, M_DEVBUF);
+	free(sc->rtsx_profiles, M_DEVBUF);
+	free(sc->rtsx_script, M_DEVBUF);
 	bus_teardown_intr(dev, sc->rtsx_irq_res, sc->rtsx_irq_cookie);	
  destroy_rtsx_res:
 	bus_release_resource(dev, SYS_RES_MEMORY, sc->rtsx_res_id,
@@ -2768,9 +5124,14 @@ rtsx_detach(device_t dev)
 
 	taskqueue_drain(taskqueue_swi_giant, &sc->rtsx_card_task);
 	taskqueue_drain_timeout(taskqueue_swi_giant, &sc->rtsx_card_delayed_task);
+	callout_drain(&sc->rtsx_timeout_callout);
+	callout_drain(&sc->rtsx_retune_callout);
 
 	/* Teardown the state in our softc created in our attach routine. */
 	rtsx_dma_free(sc);
+	free(sc->rtsx_cache, M_DEVBUF);
+	free(sc->rtsx_profiles, M_DEVBUF);
+	free(sc->rtsx_script, M_DEVBUF);
         if (sc->rtsx_res != NULL)
                 bus_release_resource(dev, SYS_RES_MEMORY, sc->rtsx_res_id,
 				     sc->rtsx_res);	
@@ -2823,9 +5184,25 @@ rtsx_suspend(device_t dev)
 static int
 rtsx_resume(device_t dev)
 {
+	struct rtsx_softc *sc = device_get_softc(dev);
+	int error = ENXIO;
+
 //	if (bootverbose)
 		device_printf(dev, "Resume\n");
 
+	/* Restore the registers, the mmc bus then powers the card up again. */
+	if (sc->rtsx_resume_replay)
+		error = rtsx_script_replay(sc);
+	if (error == 0) {
+		sc->rtsx_resume_replays++;
+	} else {
+		if (sc->rtsx_resume_replay)
+			device_printf(dev, "Register script failed, reinitializing\n");
+		sc->rtsx_resume_inits++;
+		if (rtsx_init_record(sc))
+			device_printf(dev, "Error during rtsx_init()\n");
+	}
+
 	bus_generic_resume(dev);
 
 	return (0);
@@ -200,6 +200,7 @@
 
 /* Internal clock. */
 #define	RTSX_CLK_CTL			0xFC02
+#define	RTSX_CHANGE_CLK			0x01
 #define	RTSX_CLK_LOW_FREQ		0x01
 
 /* Internal clock divisor values. */
@@ -231,6 +232,12 @@
 
 #define	RTSX_SSC_CTL2			0xFC12
 #define	RTSX_SSC_DEPTH_MASK		0x07
+#define	RTSX_SSC_DEPTH_DISABLE		0x00
+#define	RTSX_SSC_DEPTH_4M		0x01
+#define	RTSX_SSC_DEPTH_2M		0x02
+#define	RTSX_SSC_DEPTH_1M		0x03
+#define	RTSX_SSC_DEPTH_500K		0x04
+#define	RTSX_SSC_DEPTH_250K		0x05
 
 /* RC oscillator, default is 2M */
 #define	RTSX_RCCTL			0xFC14
@@ -243,6 +250,8 @@
 #define	RTSX_OLT_LED_AUTOBLINK		0x08
 
 #define	RTSX_LDO_CTL			0xFC1E
+#define	RTSX_BPP_ASIC_1V8		0x01
+#define	RTSX_BPP_ASIC_2V0		0x03
 #define	RTSX_BPP_ASIC_3V3		0x07
 #define	RTSX_BPP_ASIC_MASK		0x07
 #define	RTSX_BPP_PAD_3V3		0x04
@@ -252,6 +261,7 @@
 #define	RTSX_BPP_LDO_ON			0x00
 #define	RTSX_BPP_LDO_SUSPEND		0x02
 #define	RTSX_BPP_LDO_OFF		0x03
+#define	RTSX_BPP_SHIFT_5209		5
 #define	RTSX_BPP_SHIFT_8402		5
 #define	RTSX_BPP_SHIFT_8411		4
 
@@ -286,6 +296,14 @@
 #define	RTSX_SAMPLE_VAR_CLK0		(0x01 << 4)
 #define	RTSX_SAMPLE_VAR_CLK1		(0x02 << 4)
 
+/* Variable phase clock control registers (SD 3.0 push and sample points). */
+#define	RTSX_SD_VPCLK0_CTL		0xFC2A
+#define	RTSX_SD_VPCLK1_CTL		0xFC2B
+#define	RTSX_SD_VPTX_CTL		RTSX_SD_VPCLK0_CTL
+#define	RTSX_SD_VPRX_CTL		RTSX_SD_VPCLK1_CTL
+#define	RTSX_PHASE_CHANGE		0x80
+#define	RTSX_PHASE_NOT_RESET		0x40
+#define	RTSX_PHASE_SELECT_MASK		0x1F
 
 /* ASIC */
 #define	RTSX_CARD_PULL_CTL1		0xFD60
@@ -308,6 +326,7 @@
 #define	RTSX_CLK_DIVIDE_128		0x80
 #define	RTSX_CLK_DIVIDE_256		0xC0
 #define	RTSX_CLK_DIVIDE_MASK		0xC0
+#define	RTSX_SD_ASYNC_FIFO_NOT_RST	0x10
 #define	RTSX_SD20_MODE			0x00
 #define	RTSX_SDDDR_MODE			0x04
 #define	RTSX_SD30_MODE			0x08
@@ -386,6 +405,12 @@
 #define	RTSX_SD20_TX_NEG_EDGE		0x00
 #define	RTSX_SD20_TX_SEL_MASK		0x10
 #define	RTSX_SD20_TX_14_AHEAD		0x10
+#define	RTSX_DDR_FIX_TX_CMD_DAT		0x00
+#define	RTSX_DDR_VAR_TX_CMD_DAT		0x80
+#define	RTSX_DDR_FIX_TX_DAT_14_TSU	0x00
+#define	RTSX_DDR_FIX_TX_DAT_12_TSU	0x40
+#define	RTSX_DDR_FIX_TX_CMD_NEG_EDGE	0x00
+#define	RTSX_DDR_FIX_TX_CMD_14_AHEAD	0x20
 
 #define	RTSX_SD_CMD0			0xFDA9
 #define	  RTSX_SD_CMD_START		0x40